@@ -9,13 +9,45 @@
 #include <linux/cryptohash.h>
 #include <linux/namei.h>
 #include <linux/stat.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <crypto/skcipher.h>
+#include <linux/random.h>
+#include "xcrypt.h"
 #define COMMENT 0
 
 #define __NR_xcrypt 359
 #define MY_BUFFER_SIZE 4096
 #define MAX_FILE_LENGTH 1024
-#define MD5_KEY_LENGTH 16
-#define SHA_KEY_LENGTH 20
+/*
+ * data is encrypted in chunks of this size, must be a multiple of the
+ * AES block size so the CTR counter carries over from chunk to chunk
+ */
+#define CRYPT_CHUNK_SIZE (1024*1024)
+/*
+ * smallest segment handed to a parallel worker, a multiple of the chunk size
+ */
+#define PARALLEL_MIN_SEGMENT (16*CRYPT_CHUNK_SIZE)
+/*
+ * names tried for the temporary file before giving up
+ */
+#define TMPFILE_TRIES 8
+
+/*
+ * values of input flags, 0 decrypts and any other value encrypts, as it
+ * always did. XCRYPT_RANGE is a bit of its own above the values callers
+ * pass to encrypt
+ */
+#define XCRYPT_DECRYPT 0
+#define XCRYPT_ENCRYPT 1
+#define XCRYPT_RANGE 0x100
 
 struct input
 {
@@ -27,146 +59,843 @@ unsigned int keylen;
 int flags;
 };
 
+/*
+ * input of a range decryption, passed when flags has XCRYPT_RANGE set
+ * @in : usual input, outfile is only used when buf is NULL
+ * @offset : offset of the range in the plain text
+ * @len : length of the range
+ * @buf : user buffer of @len bytes receiving the plain text, or NULL
+ *        to write it to outfile
+ */
+struct range_input
+{
+struct input in;
+loff_t offset;
+size_t len;
+char *buf;
+};
+
 asmlinkage extern long (*sysptr)(void *arg);
 
+/*
+ * number of chunks kept in flight by the async pipeline, 0 falls back
+ * to reading, encrypting and writing one chunk at a time
+ */
+static int pipeline_depth = 4;
+module_param(pipeline_depth, int, 0644);
+MODULE_PARM_DESC(pipeline_depth, "chunks in flight in the encryption pipeline, 0 to disable");
 
+/*
+ * number of threads encrypting segments of a file in parallel, 0 or 1
+ * keeps a single thread
+ */
+static int parallel_workers;
+module_param(parallel_workers, int, 0644);
+MODULE_PARM_DESC(parallel_workers, "threads encrypting one file in parallel, 0 to disable");
 
-void sha(unsigned char *hash, char *plaintext)
+/*
+ * one segment of a parallel encryption
+ * @filp1 : input file
+ * @filp3 : output file
+ * @rpos : where the segment starts in the input
+ * @wpos : where the segment goes in the output
+ * @offset : offset of the segment in the encrypted data, for the counter
+ * @len : length of the segment
+ * @in : user input
+ * @err : result of the worker
+ * @done : completed when the worker is finished
+ */
+struct crypt_segment
 {
-	struct scatterlist sg;
-    struct crypto_hash *tfm;
-    struct hash_desc desc;
-
-    memset(hash, 0x00,SHA_KEY_LENGTH);
+	struct file *filp1;
+	struct file *filp3;
+	loff_t rpos;
+	loff_t wpos;
+	loff_t offset;
+	loff_t len;
+	struct input *in;
+	int err;
+	struct completion done;
+};
 
-    tfm = crypto_alloc_hash("sha1", 0, CRYPTO_ALG_ASYNC);
+/*
+ * one chunk of the async pipeline
+ * @buf : chunk data, encrypted in place
+ * @sgt : scatterlist over @buf
+ * @req : cipher request of the chunk
+ * @iv : counter block of the first byte of the chunk
+ * @bytes : bytes of data in the chunk
+ * @busy : set while the chunk is submitted and not written yet
+ * @err : result of the cipher request
+ * @done : completed when the cipher request is finished
+ * @queued : completed when the chunk is handed to the writer, with no
+ * bytes at the end of the data
+ * @written : completed when the writer is done with the chunk
+ */
+struct crypt_slot
+{
+	void *buf;
+	struct sg_table sgt;
+	struct skcipher_request *req;
+	u8 iv[CRYPT_IV_SIZE];
+	int bytes;
+	int busy;
+	int err;
+	struct completion done;
+	struct completion queued;
+	struct completion written;
+};
 
-    desc.tfm = tfm;
-    desc.flags = 0;
+/*
+ * writer thread of the async pipeline
+ * @filp3 : output file
+ * @wpos : where the next chunk goes in the output
+ * @slots : ring of chunks
+ * @depth : number of chunks in the ring
+ * @err : first error of the writer, later chunks are only waited for
+ * @done : completed when the writer has seen the end of the data
+ */
+struct crypt_writer
+{
+	struct file *filp3;
+	loff_t *wpos;
+	struct crypt_slot *slots;
+	int depth;
+	int err;
+	struct completion done;
+};
 
-    sg_init_one(&sg, plaintext, 10);
-    crypto_hash_init(&desc);
 
-    crypto_hash_update(&desc, &sg, 10);
-    crypto_hash_final(&desc, hash);
-	crypto_free_hash(tfm);
 
+/*
+ * crypt_free : release the transform allocated by crypt_init
+ */
+void crypt_free(struct blkcipher_desc *desc)
+{
+	if(desc->tfm)
+		crypto_free_blkcipher(desc->tfm);
+	desc->tfm=NULL;
 }
 
-int crypt(void *rbuff,void *wbuff,unsigned int bytes,struct input *in)
+/*
+ * crypt_init : allocate the transform used for a whole xcrypt call
+ * @desc : descriptor to set up
+ * @in : user input, holds the key
+ *
+ * the key and the IV are set once, every later crypt() call continues
+ * the CTR counter where the previous one stopped
+ */
+int crypt_init(struct blkcipher_desc *desc, struct input *in)
 {
 	struct crypto_blkcipher *tfm=NULL;
-    struct blkcipher_desc desc;
-	struct scatterlist *src=NULL;
-    struct scatterlist *dst=NULL;
 	unsigned char *key=in->keybuf;
 	int ret=0;
-	char *iv ="\x12\x34\x56\x78\x90\xab\xcd\xef\x12\x34\x56\x78\x90\xab\xcd\xef";
+	char *iv = CRYPT_IV;
 	unsigned int ivsize = 0;
 	char *algo = "ctr(aes)";
-	
-	src = kmalloc(sizeof(struct scatterlist), __GFP_ZERO|GFP_KERNEL);
-    if (!src) {
-        printk("[crypt]: failed to alloc src\n");     
-        ret= -1;
-		goto out;
-    }
-    dst = kmalloc(sizeof(struct scatterlist), __GFP_ZERO|GFP_KERNEL);
-    if (!dst) {
-        printk("[crypt]: failed to alloc dst\n"); 
-        ret= -1;
-		goto out;
-    }
-	
+
+	desc->tfm = NULL;
 	tfm = crypto_alloc_blkcipher(algo, 0, 0);
 	
 	 if (IS_ERR(tfm)) {
-        printk("[crypt]: failed to load transform for : %ld\n",PTR_ERR(tfm));
-		ret=-1;
-        goto out;
+        printk("[crypt_init]: failed to load transform for : %ld\n",PTR_ERR(tfm));
+		return -1;
     }
-    desc.tfm = tfm;
-    desc.flags = 0;
+    desc->tfm = tfm;
+    desc->flags = 0;
     
     ret = crypto_blkcipher_setkey(tfm, key, MD5_KEY_LENGTH);
 	 if (ret) {
-			printk("[crypt]: setkey() failed flagss=%x\n",
+			printk("[crypt_init]: setkey() failed flagss=%x\n",
             crypto_blkcipher_get_flags(tfm));
-			goto out;
+			crypt_free(desc);
+			return ret;
     }
 	
 	ivsize = crypto_blkcipher_ivsize(tfm);
 	if (ivsize) {
 		if (ivsize != strlen(iv))
-			printk("[crypt]: IV length differs from expected length\n");
+			printk("[crypt_init]: IV length differs from expected length\n");
 			crypto_blkcipher_set_iv(tfm, iv, ivsize);
 	}
-	
-	sg_init_table(src, 1);
-	sg_init_table(dst, 1);
-		
-	sg_set_buf(src, rbuff, bytes);
-	sg_set_buf(dst, wbuff, bytes);
-	
-	if(in->flags){
-		ret=crypto_blkcipher_encrypt(&desc,dst,src,bytes);
+	return 0;
+}
+
+/*
+ * crypt_sg_init : build a scatterlist over a vmalloc'ed buffer, one
+ * entry per page, so a whole chunk goes to the cipher in one call
+ */
+int crypt_sg_init(struct sg_table *sgt, void *buf, unsigned int size)
+{
+	struct scatterlist *sg;
+	unsigned int npages = DIV_ROUND_UP(size, PAGE_SIZE);
+	int ret, i;
+
+	ret = sg_alloc_table(sgt, npages, GFP_KERNEL);
+	if (ret) {
+		printk("[crypt_sg_init]: sg_alloc_table FAILED\n");
+		return ret;
+	}
+	for_each_sg(sgt->sgl, sg, npages, i)
+		sg_set_page(sg, vmalloc_to_page(buf + i * PAGE_SIZE), PAGE_SIZE, 0);
+	return 0;
+}
+
+/*
+ * crypt : encrypt or decrypt the first bytes of a chunk in place
+ * @desc : descriptor set up by crypt_init
+ * @sg : scatterlist over the chunk
+ * @bytes : number of bytes to process
+ * @in : user input, flags tell encrypt from decrypt, XCRYPT_RANGE aside
+ */
+int crypt(struct blkcipher_desc *desc, struct scatterlist *sg, unsigned int bytes, struct input *in)
+{
+	int ret=0;
+
+	if((in->flags & ~XCRYPT_RANGE) != XCRYPT_DECRYPT){
+		ret=crypto_blkcipher_encrypt(desc,sg,sg,bytes);
 		if(ret<0)
-		{
 			printk("[crypt]: crypto_blkcipher_encrypt FAILED");
-			goto out;
-		}
 	}
 	else{
-		ret=crypto_blkcipher_decrypt(&desc,dst,src,bytes);
+		ret=crypto_blkcipher_decrypt(desc,sg,sg,bytes);
 		if(ret<0)
-		{
 			printk("[crypt]: crypto_blkcipher_decrypt FAILED");
+	}	
+	return ret;
+}
+
+/*
+ * read_full : read until the buffer is full or the file ends, so every
+ * chunk but the last one is a multiple of the AES block size
+ */
+int read_full(struct file *filp, void *buf, unsigned int size, loff_t *pos)
+{
+	mm_segment_t oldfs;
+	unsigned int done=0;
+	int ret=0;
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	while(done<size)
+	{
+		ret=vfs_read(filp, buf+done, size-done, pos);
+		if(ret<=0)
+			break;
+		done+=ret;
+	}
+	set_fs(oldfs);
+	return (ret<0) ? ret : done;
+}
+
+
+
+/*
+ * crypt_serial : read, encrypt and write the data one chunk at a time
+ * @filp1 : input file, read from @rpos
+ * @filp3 : output file, written at @wpos
+ * @in : user input
+ */
+int crypt_serial(struct file *filp1, loff_t *rpos, struct file *filp3, loff_t *wpos, struct input *in)
+{
+    void *rbuff=NULL;
+	int err=0;
+	int bytes=0;
+	mm_segment_t oldfs;
+	struct blkcipher_desc desc;
+	struct sg_table sgt;
+	
+	desc.tfm=NULL;
+	sgt.sgl=NULL;
+	
+	rbuff = vmalloc(CRYPT_CHUNK_SIZE);
+	if (!rbuff) {
+		printk("[crypt_serial] : vmalloc FAILED");
+    	err = -ENOMEM;
+		goto out;
+  	}
+	err = crypt_sg_init(&sgt, rbuff, CRYPT_CHUNK_SIZE);
+	if (err) {
+		sgt.sgl=NULL;
+		goto out;
+	}
+	err = crypt_init(&desc, in);
+	if (err) {
+		printk("[crypt_serial] : crypt_init FAILED");
+		goto out;
+	}
+	
+	 do{	
+	bytes=read_full(filp1, rbuff, CRYPT_CHUNK_SIZE, rpos);
+
+	if(bytes<0)
+	{
+		printk("[crypt_serial]: vfs_read FAILED\n");
+		err=bytes;
+		goto out;
+	}
+	if(bytes==0)
+		break;
+	
+	err=crypt(&desc,sgt.sgl,bytes,in);
+	if(err<0)
+	{
+		printk("[crypt_serial]: crypt FAILED\n");
+		goto out;
+	}
+	
+	oldfs = get_fs();
+    set_fs(KERNEL_DS);
+	err=vfs_write(filp3, rbuff, bytes, wpos);
+	set_fs(oldfs);
+	if(err<0)
+	{
+		printk("[crypt_serial]: vfs_write FAILED\n");
+		goto out;
+	}
+	err=0;
+	
+	}while(bytes==CRYPT_CHUNK_SIZE);
+
+out:
+	crypt_free(&desc);
+	if(sgt.sgl)
+		sg_free_table(&sgt);
+	if(rbuff)
+		vfree(rbuff);
+	return err;
+}
+
+/*
+ * crypt_slot_done : completion callback of an async cipher request
+ */
+void crypt_slot_done(struct crypto_async_request *areq, int err)
+{
+	struct crypt_slot *slot = areq->data;
+
+	//a backlogged request was queued, the real completion follows
+	if (err == -EINPROGRESS)
+		return;
+	slot->err = err;
+	complete(&slot->done);
+}
+
+/*
+ * crypt_slot_submit : start encrypting or decrypting a chunk
+ * @slot : chunk, its data is at offset @offset of the encrypted data
+ *
+ * synchronous implementations finish before returning, async ones
+ * complete the slot from crypt_slot_done
+ */
+void crypt_slot_submit(struct crypt_slot *slot, loff_t offset, struct input *in)
+{
+	int ret;
+
+	ctr_iv_at(slot->iv, offset);
+	reinit_completion(&slot->done);
+	slot->busy = 1;
+	slot->err = 0;
+	skcipher_request_set_crypt(slot->req, slot->sgt.sgl, slot->sgt.sgl, slot->bytes, slot->iv);
+	if (in->flags)
+		ret = crypto_skcipher_encrypt(slot->req);
+	else
+		ret = crypto_skcipher_decrypt(slot->req);
+	if (ret == -EINPROGRESS || ret == -EBUSY)
+		return;
+	slot->err = ret;
+	complete(&slot->done);
+}
+
+/*
+ * crypt_slot_retire : wait for a chunk to be processed and write it out
+ */
+int crypt_slot_retire(struct crypt_slot *slot, struct file *filp3, loff_t *wpos)
+{
+	mm_segment_t oldfs;
+	int err;
+
+	wait_for_completion(&slot->done);
+	slot->busy = 0;
+	if (slot->err) {
+		printk("[crypt_slot_retire]: cipher request FAILED\n");
+		return slot->err;
+	}
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	err = vfs_write(filp3, slot->buf, slot->bytes, wpos);
+	set_fs(oldfs);
+	if (err < 0) {
+		printk("[crypt_slot_retire]: vfs_write FAILED\n");
+		return err;
+	}
+	return 0;
+}
+
+/*
+ * crypt_writer_run : write the chunks of the pipeline out in file order
+ * @data : crypt_writer of the pipeline
+ *
+ * runs on its own thread so the write of a chunk overlaps with the read
+ * and encryption of the next ones, also when the cipher is synchronous
+ */
+int crypt_writer_run(void *data)
+{
+	struct crypt_writer *w = data;
+	struct crypt_slot *slot;
+	int n;
+	int err;
+
+	for (n = 0; ; n++) {
+		slot = &w->slots[n % w->depth];
+		wait_for_completion(&slot->queued);
+		if (slot->bytes <= 0)
+			break;
+		if (!w->err) {
+			err = crypt_slot_retire(slot, w->filp3, w->wpos);
+			if (err)
+				w->err = err;
+		} else {
+			wait_for_completion(&slot->done);
+			slot->busy = 0;
+		}
+		complete(&slot->written);
+	}
+	complete(&w->done);
+	return 0;
+}
+
+/*
+ * crypt_pipeline : read, encrypt and write with several chunks in flight
+ * @filp1 : input file, read from @rpos
+ * @filp3 : output file, written at @wpos
+ * @in : user input
+ *
+ * chunks go round a ring of pipeline_depth slots. Each chunk gets its
+ * own request whose counter is derived from its offset. This thread
+ * reads and submits chunks, a writer thread writes them out in file
+ * order, so writes overlap with reads and encryption. An async cipher
+ * also encrypts while the next chunk is read
+ */
+int crypt_pipeline(struct file *filp1, loff_t *rpos, struct file *filp3, loff_t *wpos, struct input *in)
+{
+	struct crypto_skcipher *tfm=NULL;
+	struct crypt_slot *slots=NULL, *slot;
+	struct crypt_writer w;
+	struct task_struct *task;
+	loff_t offset=0;
+	int depth=pipeline_depth;
+	int err=0;
+	int n=0;
+	int k;
+
+	tfm = crypto_alloc_skcipher("ctr(aes)", 0, 0);
+	if (IS_ERR(tfm)) {
+		printk("[crypt_pipeline]: failed to load transform for : %ld\n",PTR_ERR(tfm));
+		return PTR_ERR(tfm);
+	}
+	err = crypto_skcipher_setkey(tfm, in->keybuf, MD5_KEY_LENGTH);
+	if (err) {
+		printk("[crypt_pipeline]: setkey() FAILED\n");
+		goto out;
+	}
+
+	slots = kcalloc(depth, sizeof(struct crypt_slot), GFP_KERNEL);
+	if (!slots) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (k = 0; k < depth; k++) {
+		slot = &slots[k];
+		init_completion(&slot->done);
+		init_completion(&slot->queued);
+		init_completion(&slot->written);
+		slot->buf = vmalloc(CRYPT_CHUNK_SIZE);
+		slot->req = skcipher_request_alloc(tfm, GFP_KERNEL);
+		if (!slot->buf || !slot->req) {
+			err = -ENOMEM;
 			goto out;
 		}
-	}	
-			
+		err = crypt_sg_init(&slot->sgt, slot->buf, CRYPT_CHUNK_SIZE);
+		if (err) {
+			slot->sgt.sgl = NULL;
+			goto out;
+		}
+		skcipher_request_set_callback(slot->req, CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
+					      crypt_slot_done, slot);
+	}
+
+	w.filp3 = filp3;
+	w.wpos = wpos;
+	w.slots = slots;
+	w.depth = depth;
+	w.err = 0;
+	init_completion(&w.done);
+	task = kthread_run(crypt_writer_run, &w, "xcrypt/writer");
+	if (IS_ERR(task)) {
+		err = PTR_ERR(task);
+		goto out;
+	}
+
+	//a chunk with no bytes tells the writer the data ends there
+	for (n = 0; ; n++) {
+		slot = &slots[n % depth];
+		if (n >= depth)
+			wait_for_completion(&slot->written);
+		slot->bytes = 0;
+		if (w.err)
+			break;
+		slot->bytes = read_full(filp1, slot->buf, CRYPT_CHUNK_SIZE, rpos);
+		if (slot->bytes < 0) {
+			printk("[crypt_pipeline]: vfs_read FAILED\n");
+			err = slot->bytes;
+			break;
+		}
+		if (slot->bytes == 0)
+			break;
+		crypt_slot_submit(slot, offset, in);
+		offset += slot->bytes;
+		complete(&slot->queued);
+	}
+	complete(&slot->queued);
+	wait_for_completion(&w.done);
+	if (!err)
+		err = w.err;
+
 out:
-    if(dst)
-		kfree(dst);
-	if(src)
-		kfree(src);
-	if(tfm)
-		crypto_free_blkcipher(tfm);
+	if (slots) {
+		for (k = 0; k < depth; k++) {
+			slot = &slots[k];
+			if (slot->req)
+				skcipher_request_free(slot->req);
+			if (slot->sgt.sgl)
+				sg_free_table(&slot->sgt);
+			if (slot->buf)
+				vfree(slot->buf);
+		}
+		kfree(slots);
+	}
+	crypto_free_skcipher(tfm);
+	return err;
+}
 
-	return ret;
+/*
+ * crypt_segment_run : worker encrypting one segment with its own transform
+ * @data : crypt_segment to process
+ *
+ * the counter starts at the value for the segment offset, reads and
+ * writes use positions of their own so segments never touch each other
+ */
+int crypt_segment_run(void *data)
+{
+	struct crypt_segment *seg = data;
+	struct blkcipher_desc desc;
+	struct sg_table sgt;
+	mm_segment_t oldfs;
+	u8 iv[CRYPT_IV_SIZE];
+	void *buf=NULL;
+	loff_t left = seg->len;
+	int bytes;
+	int err=0;
+
+	desc.tfm=NULL;
+	sgt.sgl=NULL;
+
+	buf = vmalloc(CRYPT_CHUNK_SIZE);
+	if (!buf) {
+		err = -ENOMEM;
+		goto out;
+	}
+	err = crypt_sg_init(&sgt, buf, CRYPT_CHUNK_SIZE);
+	if (err) {
+		sgt.sgl=NULL;
+		goto out;
+	}
+	err = crypt_init(&desc, seg->in);
+	if (err)
+		goto out;
+	ctr_iv_at(iv, seg->offset);
+	crypto_blkcipher_set_iv(desc.tfm, iv, CRYPT_IV_SIZE);
+
+	while (left > 0) {
+		bytes = read_full(seg->filp1, buf, min_t(loff_t, left, CRYPT_CHUNK_SIZE), &seg->rpos);
+		if (bytes <= 0) {
+			//file shrank under us
+			err = (bytes < 0) ? bytes : -EIO;
+			goto out;
+		}
+		err = crypt(&desc, sgt.sgl, bytes, seg->in);
+		if (err < 0)
+			goto out;
+		oldfs = get_fs();
+		set_fs(KERNEL_DS);
+		err = vfs_write(seg->filp3, buf, bytes, &seg->wpos);
+		set_fs(oldfs);
+		if (err < 0)
+			goto out;
+		err = 0;
+		left -= bytes;
+	}
+
+out:
+	crypt_free(&desc);
+	if (sgt.sgl)
+		sg_free_table(&sgt);
+	if (buf)
+		vfree(buf);
+	seg->err = err;
+	complete(&seg->done);
+	return 0;
+}
+
+/*
+ * crypt_parallel : encrypt a file as segments on several threads
+ * @filp1 : input file, read from @rpos
+ * @filp3 : output file, written at @wpos
+ * @in : user input
+ * @size : bytes of data left in the input
+ *
+ * CTR keystream only depends on the counter, so each segment is
+ * processed on its own with the counter derived from its offset
+ */
+int crypt_parallel(struct file *filp1, loff_t *rpos, struct file *filp3, loff_t *wpos, struct input *in, loff_t size)
+{
+	struct crypt_segment *segs=NULL;
+	struct task_struct *task;
+	loff_t seglen;
+	int nseg = min_t(int, parallel_workers, num_online_cpus());
+	int err=0;
+	int k;
+
+	if (nseg > DIV_ROUND_UP_ULL(size, PARALLEL_MIN_SEGMENT))
+		nseg = DIV_ROUND_UP_ULL(size, PARALLEL_MIN_SEGMENT);
+	if (nseg < 1)
+		nseg = 1;
+	seglen = DIV_ROUND_UP_ULL(DIV_ROUND_UP_ULL(size, nseg), CRYPT_CHUNK_SIZE) * CRYPT_CHUNK_SIZE;
+
+	segs = kcalloc(nseg, sizeof(struct crypt_segment), GFP_KERNEL);
+	if (!segs)
+		return -ENOMEM;
+	for (k = 0; k < nseg; k++) {
+		segs[k].filp1 = filp1;
+		segs[k].filp3 = filp3;
+		segs[k].offset = k * seglen;
+		segs[k].rpos = *rpos + segs[k].offset;
+		segs[k].wpos = *wpos + segs[k].offset;
+		segs[k].len = min_t(loff_t, seglen, size - segs[k].offset);
+		segs[k].in = in;
+		init_completion(&segs[k].done);
+	}
+	//a segment is done inline if no thread can be started for it
+	for (k = 0; k < nseg; k++) {
+		task = kthread_run(crypt_segment_run, &segs[k], "xcrypt/%d", k);
+		if (IS_ERR(task))
+			crypt_segment_run(&segs[k]);
+	}
+	for (k = 0; k < nseg; k++) {
+		wait_for_completion(&segs[k].done);
+		if (segs[k].err && !err)
+			err = segs[k].err;
+	}
+	if (!err) {
+		*rpos += size;
+		*wpos += size;
+	}
+	kfree(segs);
+	return err;
+}
+
+/*
+ * crypt_range : decrypt only a byte range of an encrypted file
+ * @filp1 : encrypted file
+ * @filp3 : file receiving the plain text, or NULL to copy to rin->buf
+ * @in : user input, holds the key
+ * @rin : range to decrypt
+ *
+ * the counter for the block holding the first byte is computed from
+ * its offset, so only the blocks of the range are read and decrypted
+ *
+ * returns number of bytes decrypted, less than asked at end of file,
+ * -ve in case of error
+ */
+long crypt_range(struct file *filp1, struct file *filp3, struct input *in, struct range_input *rin)
+{
+	unsigned char preamble[SHA_KEY_LENGTH], new_preamble[SHA_KEY_LENGTH];
+	struct blkcipher_desc desc;
+	struct sg_table sgt;
+	mm_segment_t oldfs;
+	u8 iv[CRYPT_IV_SIZE];
+	void *buf=NULL;
+	loff_t aligned = rin->offset & ~((loff_t)CRYPT_IV_SIZE - 1);
+	loff_t rpos = 0, wpos = 0;
+	loff_t left;
+	unsigned int skip = rin->offset - aligned;
+	long done = 0;
+	int bytes;
+	int err=0;
+
+	desc.tfm=NULL;
+	sgt.sgl=NULL;
+
+	//check the key against the preamble before decrypting anything
+	sha(preamble, in->keybuf);
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	err = vfs_read(filp1, new_preamble, SHA_KEY_LENGTH, &rpos);
+	set_fs(oldfs);
+	if (err != SHA_KEY_LENGTH || memcmp(preamble, new_preamble, SHA_KEY_LENGTH)) {
+		printk("\nwrong decrypt key, DECRYTION FAILED \n");
+		return -EINVAL;
+	}
+
+	buf = vmalloc(CRYPT_CHUNK_SIZE);
+	if (!buf) {
+		err = -ENOMEM;
+		goto out;
+	}
+	err = crypt_sg_init(&sgt, buf, CRYPT_CHUNK_SIZE);
+	if (err) {
+		sgt.sgl=NULL;
+		goto out;
+	}
+	err = crypt_init(&desc, in);
+	if (err)
+		goto out;
+	ctr_iv_at(iv, aligned);
+	crypto_blkcipher_set_iv(desc.tfm, iv, CRYPT_IV_SIZE);
+
+	rpos = SHA_KEY_LENGTH + aligned;
+	left = rin->len + skip;
+	while (left > 0) {
+		bytes = read_full(filp1, buf, min_t(loff_t, left, CRYPT_CHUNK_SIZE), &rpos);
+		if (bytes < 0) {
+			err = bytes;
+			goto out;
+		}
+		if (bytes <= skip)
+			break;
+		err = crypt(&desc, sgt.sgl, bytes, in);
+		if (err < 0)
+			goto out;
+		if (filp3) {
+			oldfs = get_fs();
+			set_fs(KERNEL_DS);
+			err = vfs_write(filp3, buf + skip, bytes - skip, &wpos);
+			set_fs(oldfs);
+			if (err < 0)
+				goto out;
+		} else if (copy_to_user(rin->buf + done, buf + skip, bytes - skip)) {
+			err = -EFAULT;
+			goto out;
+		}
+		err = 0;
+		done += bytes - skip;
+		left -= bytes;
+		skip = 0;
+		if (bytes < CRYPT_CHUNK_SIZE)
+			break;
+	}
+
+out:
+	crypt_free(&desc);
+	if (sgt.sgl)
+		sg_free_table(&sgt);
+	if (buf)
+		vfree(buf);
+	return err ? err : done;
+}
+
+/*
+ * tmpfile_open : open an unnamed temporary file in the directory of the
+ * output file, nothing is left behind if the call fails half way
+ * @filp2 : output file, its mode is given to the temporary file
+ *
+ * the directory is the parent of the opened output, on its mount, so
+ * tmpfile_publish links the file into that same directory whatever
+ * symlinks or bind mounts the output path went through
+ */
+struct file *tmpfile_open(struct file *filp2)
+{
+	struct file *filp=NULL;
+	struct dentry *dir;
+
+	dir = dget_parent(filp2->f_path.dentry);
+	filp = file_open_root(dir, filp2->f_path.mnt, ".", O_TMPFILE|O_WRONLY,
+			      file_inode(filp2)->i_mode & S_IALLUGO);
+	dput(dir);
+	return filp;
 }
 
+/*
+ * tmpfile_publish : give the temporary file a per call name next to
+ * the output and rename it over the output in one step
+ * @filp3 : temporary file opened by tmpfile_open
+ * @filp2 : output file
+ *
+ * the name carries a random part, a name left by a crashed call with
+ * the same pid is skipped by trying another one. If the rename fails
+ * the name is removed again
+ */
+int tmpfile_publish(struct file *filp3, struct file *filp2)
+{
+	struct dentry *dir = filp2->f_path.dentry->d_parent;
+	struct dentry *newd=NULL;
+	char name[40];
+	int tries;
+	int err=0;
+
+	for (tries = 0; tries < TMPFILE_TRIES; tries++) {
+		snprintf(name, sizeof(name), ".xcrypt.%d.%08x.tmp",
+			 task_pid_nr(current), get_random_int());
 
+		mutex_lock_nested(&dir->d_inode->i_mutex, I_MUTEX_PARENT);
+		newd = lookup_one_len(name, dir, strlen(name));
+		if (IS_ERR(newd)) {
+			mutex_unlock(&dir->d_inode->i_mutex);
+			return PTR_ERR(newd);
+		}
+		err = vfs_link(filp3->f_path.dentry, dir->d_inode, newd, NULL);
+		mutex_unlock(&dir->d_inode->i_mutex);
+		if (err != -EEXIST)
+			break;
+		dput(newd);
+		newd = NULL;
+	}
+	if (err) {
+		printk("[tmpfile_publish]: vfs_link FAILED\n");
+		goto out;
+	}
+
+	lock_rename(dir, dir);
+	err = vfs_rename(dir->d_inode, newd, dir->d_inode, filp2->f_path.dentry, NULL, 0);
+	unlock_rename(dir, dir);
+	if (err) {
+		printk("[tmpfile_publish]: vfs_rename FAILED\n");
+		mutex_lock_nested(&dir->d_inode->i_mutex, I_MUTEX_PARENT);
+		vfs_unlink(dir->d_inode, newd, NULL);
+		mutex_unlock(&dir->d_inode->i_mutex);
+	}
+out:
+	dput(newd);
+	return err;
+}
 
 int rwfile(struct file *filp1, struct file *filp2, struct input *in)
 {
-    void *rbuff=NULL, *wbuff=NULL;
 	unsigned char *preamble=NULL,*new_preamble=NULL,*key=in->keybuf;
 	int err=0;
-	unsigned int bytes=MY_BUFFER_SIZE;
 	loff_t rpos = 0, wpos=0;
+	loff_t size;
 	mm_segment_t oldfs;
 	struct file *filp3=NULL;
 	
-    filp3 = filp_open("a.tmp", MAY_WRITE|O_CREAT|O_TRUNC, 0);
-	if(!filp3){
+    filp3 = tmpfile_open(filp2);
+	if(!filp3 || IS_ERR(filp3)){
 		printk("[rwfile] : temporary file open FAILED");
-		err = -1;
+		err = filp3 ? PTR_ERR(filp3) : -1;
+		filp3 = NULL;
 		goto out;
 	}
 	
-	rbuff = kmalloc(MY_BUFFER_SIZE,GFP_KERNEL);
-	if (!rbuff) {
-		printk("[rwfile] : kmalloc FAILED");
-    	err = -ENOMEM;
-		goto out;
-  	}
-	wbuff = kmalloc(MY_BUFFER_SIZE,GFP_KERNEL);
-	if (!wbuff) {
-		printk("[rwfile] : kmalloc FAILED");
-    	err = -ENOMEM;
-		goto out;
-  	}
 	preamble = kmalloc(SHA_KEY_LENGTH,GFP_KERNEL);
 	if (!preamble) {
 		printk("[rwfile] : kmalloc FAILED");
@@ -217,79 +946,27 @@ int rwfile(struct file *filp1, struct file *filp2, struct input *in)
 		}
 	}
 	
-	 do{	
-	oldfs = get_fs();
-    set_fs(KERNEL_DS);
-	bytes=vfs_read(filp1, rbuff, PAGE_SIZE, &rpos);
-	set_fs(oldfs);
-
-	if(bytes<0)
-	{
-		printk("[rwfile]: vfs_read FAILED\n");
-		err=bytes;
-		goto out;
-	}
-	
-	err=crypt(rbuff,wbuff,bytes,in);
-	if(err<0)
+	size=i_size_read(file_inode(filp1))-rpos;
+	if(parallel_workers>1 && size>=2*PARALLEL_MIN_SEGMENT)
+		err=crypt_parallel(filp1, &rpos, filp3, &wpos, in, size);
+	else if(pipeline_depth>0)
+		err=crypt_pipeline(filp1, &rpos, filp3, &wpos, in);
+	else
+		err=crypt_serial(filp1, &rpos, filp3, &wpos, in);
+	if(err)
 	{
 		printk("[rwfile]: crypt FAILED\n");
 		goto out;
 	}
 	
-	oldfs = get_fs();
-    set_fs(KERNEL_DS);
-	err=vfs_write(filp3, wbuff, bytes, &wpos);
-	if(bytes<0)
-	{
-		printk("[rwfile]: vfs_write FAILED\n");
-		goto out;
-	}
-	set_fs(oldfs);
-	
-	}while(bytes>0);
-	
-	
-	memset(rbuff,0,MY_BUFFER_SIZE);
-	memset(wbuff,0,MY_BUFFER_SIZE);
-	rpos=0;
-	wpos=0;
-	
-	
-	 do{
-		 
-	oldfs = get_fs();
-    set_fs(KERNEL_DS);
-	
-	bytes=vfs_read(filp3, rbuff, PAGE_SIZE, &rpos);
-	
-	if(bytes<0)
+	//everything is in the temporary file, put it in place of the output
+	err=tmpfile_publish(filp3, filp2);
+	if(err)
 	{
-		printk("[rwfile]: vfs_read FAILED\n");
+		printk("[rwfile]: publishing output FAILED\n");
 		goto out;
 	}
 	
-	
-	err=vfs_write(filp2, rbuff, bytes, &wpos);
-	
-	if(bytes<0)
-	{
-		printk("[rwfile]: vfs_write FAILED\n");
-		goto out;
-	}
-	set_fs(oldfs);
-	
-	}while(bytes>0);
-	
-	
-	lock_rename(filp3->f_path.dentry->d_parent,filp2->f_path.dentry->d_parent);
-    
-    vfs_unlink(filp3->f_path.dentry->d_parent->d_inode,filp3->f_path.dentry, NULL);
-	
-    unlock_rename(filp3->f_path.dentry->d_parent,filp2->f_path.dentry->d_parent);
-	
-	
-	
 out:
 	if(filp3)
 		filp_close(filp3, NULL);
@@ -297,15 +974,74 @@ out:
 		kfree(new_preamble);
 	if(preamble)
 		kfree(preamble);
-	if(wbuff)
-		kfree(wbuff);
-	if(rbuff)
-		kfree(rbuff);
 	
 
 	return err;
 }
 
+/*
+ * xcrypt_range : decrypt a byte range, into the user buffer or outfile
+ * @arg : user struct range_input
+ * @in : kernel copy of the input, with the key copied in
+ */
+long xcrypt_range(void *arg, struct input *in)
+{
+	struct range_input rin;
+	struct file *filp1=NULL, *filp2=NULL, *filp3=NULL;
+	long err=0;
+
+	if (copy_from_user(&rin, arg, sizeof(struct range_input))) {
+		printk("[xcrypt_range]: copy_from_user FAILED\n");
+		return -EFAULT;
+	}
+	if (rin.offset < 0 || rin.len > INT_MAX)
+		return -EINVAL;
+	//a range is only ever decrypted
+	in->flags = XCRYPT_RANGE | XCRYPT_DECRYPT;
+
+	filp1 = filp_open(in->infile, O_RDONLY, 0);
+	if (!filp1 || IS_ERR(filp1)) {
+		err = filp1 ? PTR_ERR(filp1) : -EINVAL;
+		filp1 = NULL;
+		goto out;
+	}
+	if (!rin.buf) {
+		filp2 = filp_open(in->outfile, O_WRONLY|O_CREAT, 0644);
+		if (!filp2 || IS_ERR(filp2)) {
+			err = filp2 ? PTR_ERR(filp2) : -EINVAL;
+			filp2 = NULL;
+			goto out;
+		}
+		if (filp1->f_inode == filp2->f_inode) {
+			printk("[xcrypt_range]: The two files are same\n");
+			err = -EINVAL;
+			goto out;
+		}
+		filp3 = tmpfile_open(filp2);
+		if (!filp3 || IS_ERR(filp3)) {
+			err = filp3 ? PTR_ERR(filp3) : -EINVAL;
+			filp3 = NULL;
+			goto out;
+		}
+	}
+
+	err = crypt_range(filp1, filp3, in, &rin);
+	if (err >= 0 && filp3) {
+		int ret = tmpfile_publish(filp3, filp2);
+		if (ret)
+			err = ret;
+	}
+
+out:
+	if (filp3)
+		filp_close(filp3, NULL);
+	if (filp2)
+		filp_close(filp2, NULL);
+	if (filp1)
+		filp_close(filp1, NULL);
+	return err;
+}
+
 asmlinkage long xcrypt(void *arg)
 {
 	struct kstat sb;
@@ -339,6 +1075,12 @@ asmlinkage long xcrypt(void *arg)
     	goto out_ok;
   	}
 	
+	//range decryption takes a longer input and may have no outfile
+	if ((in->flags & XCRYPT_RANGE) != 0) {
+		err = xcrypt_range(arg, in);
+		goto out_ok;
+	}
+	
 	vfs_stat(u_in->infile, &sb);
     if ((sb.mode & S_IFMT) != S_IFREG) {
 		printk("[xcrypt]: Infile is not a regular file\n");
@@ -397,6 +1139,8 @@ asmlinkage long xcrypt(void *arg)
 
 }
 
+EXPORT_SYMBOL(xcrypt);
+
 static int __init init_sys_xcrypt(void)
 {
 	printk("installed new sys_xcrypt module\n");
@@ -406,7 +1150,7 @@ static int __init init_sys_xcrypt(void)
 }
 static void  __exit exit_sys_xcrypt(void)
 {
-	if (sysptr != NULL)
+	if (sysptr == xcrypt)
 		sysptr = NULL;
 	printk("removed sys_xcrypt module\n");
 }
@@ -7,7 +7,22 @@
 #include <linux/uaccess.h>
 #include <linux/fs.h>
 #include <linux/namei.h>
+#include <linux/vmalloc.h>
+#include <linux/zlib.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/math64.h>
+#include <linux/crypto.h>
+#include <linux/scatterlist.h>
+#include <linux/crc32c.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/ctype.h>
 #include "xmerge.h"
+#include "xcrypt.h"
 /*
  * max size of the output buffer, that will store data to be written, temporarily
  */
@@ -27,182 +42,2996 @@
 #define F_CHECK_SORTED 0x10
 #define F_RET_COUNT 0x20
 
+/*
+ * Set operation flags, walk both inputs in lockstep like comm(1)
+ * and only emit the selected class of lines
+ */
+#define F_SET_COMMON 0x40
+#define F_SET_ONLY1 0x80
+#define F_SET_ONLY2 0x100
+#define F_SET_SYMDIFF 0x200
+#define F_SET_MASK (F_SET_COMMON | F_SET_ONLY1 | F_SET_ONLY2 | F_SET_SYMDIFF)
+
+/*
+ * write the output as a zlib stream, compressed inputs are detected
+ * on their own and need no flag
+ */
+#define F_COMPRESS_OUT 0x400
+
+/*
+ * magic bytes of the compressed input formats we can read
+ */
+#define GZIP_MAGIC1 0x1f
+#define GZIP_MAGIC2 0x8b
+#define GZIP_HDR_SIZE 10
+#define GZIP_FEXTRA 0x04
+#define GZIP_FNAME 0x08
+#define GZIP_FCOMMENT 0x10
+#define GZIP_FHCRC 0x02
+#define ZLIB_MAGIC 0x78
+
+/*
+ * write a checkpoint of the merge on every flush of the output buffer,
+ * resume continues a merge from such checkpoint
+ */
+#define F_CHECKPOINT 0x800
+#define F_RESUME 0x1000
+
+/*
+ * magic value at the start of a checkpoint file
+ */
+#define CKPT_MAGIC 0x584d434b
+
+/*
+ * publish the progress of the merge in user memory on every flush
+ */
+#define F_PROGRESS 0x2000
+
+/*
+ * only check if infile1 is sorted, nothing is written
+ */
+#define F_VERIFY_ONLY 0x4000
+
+/*
+ * verify-only splits the file in at most this many ranges, and never
+ * makes a range smaller than VERIFY_MIN_RANGE bytes
+ */
+#define VERIFY_MAX_RANGES 64
+#define VERIFY_MIN_RANGE (1024 * 1024)
+
+/*
+ * size of the chunks each verify worker reads at a time
+ */
+#define VERIFY_BUF_SIZE (16 * PAGE_SIZE)
+
+/*
+ * write a sparse index of the output next to it
+ */
+#define F_INDEX 0x8000
+
+/*
+ * index entries are buffered and written a page at a time
+ */
+#define IDX_BUF_ENTRIES (PAGE_SIZE / sizeof(xidxent))
+
+/*
+ * only merge the lines in [lokey, hikey) of both inputs
+ */
+#define F_KEY_RANGE 0x10000
+
+/*
+ * inputs are xcrypt encrypted files, decrypted as they are read, and
+ * the output is encrypted as it is written, both with the same key
+ */
+#define F_DECRYPT_IN 0x20000
+#define F_ENCRYPT_OUT 0x40000
+
+/*
+ * crc32c of the output file is computed while it is written
+ */
+#define F_CHECKSUM 0x80000
+
+/*
+ * merge into a user buffer instead of the output file, see mergecont
+ */
+#define F_USER_BUF 0x100000
+
+/*
+ * stop the merge after a number of output lines
+ */
+#define F_LINE_LIMIT 0x200000
+
+/*
+ * inputs are trusted to be sorted, long runs from one input are copied
+ * to the output as a block, see gallop_run
+ */
+#define F_GALLOP 0x400000
+
+/*
+ * lines in a row taken from one input before galloping starts, as in timsort
+ */
+#define GALLOP_MIN 7
+
+/*
+ * durability of the output
+ * F_PREALLOC : allocate the output in one go, sized to the sum of the
+ * inputs, and cut it to its final size at the end
+ * F_WRITEBACK : start writeback of the output while the merge goes on
+ * F_SYNC : fdatasync the output before it is renamed in place
+ */
+#define F_PREALLOC 0x800000
+#define F_WRITEBACK 0x1000000
+#define F_SYNC 0x2000000
+
+/*
+ * sharded output, each line goes to one of several outputs, picked by
+ * the key range it falls in or by a hash of the line
+ */
+#define F_SHARD_RANGE 0x4000000
+#define F_SHARD_HASH 0x8000000
+#define F_SHARD_MASK (F_SHARD_RANGE | F_SHARD_HASH)
+
+/*
+ * incremental merge, the delta in infile2 is merged into the base in
+ * infile1 in place, see incr_setup
+ */
+#define F_INCREMENTAL 0x10000000
+
+/*
+ * front coded output, see XFC_MAGIC. Front coded inputs are recognised
+ * by their header and decoded whatever the flags
+ */
+#define F_FRONT_CODE 0x20000000
+
+/*
+ * scratch space of the cipher, a whole buffer plus the partial AES
+ * block in front of it
+ */
+#define CIPHER_SCRATCH_SIZE (max_t(size_t, MAX_INBUF_SIZE, MAX_OUTBUF_SIZE) + CRYPT_IV_SIZE)
+
 asmlinkage extern long
 (*sysptr) (void *arg);
 
+/*
+ * MiB of output between two checkpoints, each one syncs the output
+ */
+static int ckpt_mb = 64;
+module_param(ckpt_mb, int, 0644);
+MODULE_PARM_DESC(ckpt_mb, "MiB of output between two checkpoints");
+
+/*
+ * the checkpoint file holds two slots written in turn, so a crash while
+ * one is written leaves the other one to resume from
+ */
+#define CKPT_SLOT(n) ((loff_t) (n) * 2 * PAGE_SIZE)
+
+/*
+ * number of merge contexts kept around for reuse between calls
+ */
+static int ctx_pool_size = 4;
+module_param(ctx_pool_size, int, 0444);
+MODULE_PARM_DESC(ctx_pool_size, "number of preallocated merge contexts");
+
+/*
+ * number of worker threads for verify-only, 0 means one per online cpu
+ */
+static int verify_workers;
+module_param(verify_workers, int, 0644);
+MODULE_PARM_DESC(verify_workers, "threads used to verify sortedness, 0 for one per cpu");
+
+/*
+ * read plain inputs straight from their page cache pages, 0 goes through
+ * vfs_read and the chunk buffer
+ */
+static int page_reads = 1;
+module_param(page_reads, int, 0644);
+MODULE_PARM_DESC(page_reads, "read plain inputs from the page cache, 0 to use vfs_read");
+
+/*
+ * with F_WRITEBACK, writeback of the output is started every this many KiB
+ */
+static int writeback_kb = 8192;
+module_param(writeback_kb, int, 0644);
+MODULE_PARM_DESC(writeback_kb, "KiB of output between writeback starts");
+
+
+/*
+ * Cipher state of an encrypted merge, shared by the inputs and the output
+ * @desc : ctr(aes) transform keyed with the user key
+ * @scratch : CIPHER_SCRATCH_SIZE bytes the data is encrypted in
+ * @preamble : SHA1 preamble of the key, found at the start of every file
+ */
+typedef struct cryptstate {
+	struct blkcipher_desc desc;
+	char *scratch;
+	unsigned char preamble[SHA_KEY_LENGTH];
+} cryptstate;
 
 /*
  * Structure to store output data temporarily
  * @buffer : char pointer contain data
  * @currsize : current size of output buffer at any given time
  * @availsize : available empty space in buffer at any given time
+ * @zstrm : deflate stream if the output is compressed, NULL otherwise
+ * @zbuf : compressed bytes waiting to be written
+ * @lines : number of lines put into the buffer so far
+ * @ckpt : checkpoint state if checkpoints are taken, NULL otherwise
+ * @progress : user memory where progress is published, NULL otherwise
+ * @src1, @src2 : input buffers feeding this output, for progress
+ * @idx : sparse index written with the output, NULL otherwise
+ * @cs : cipher state if the output is encrypted, NULL otherwise
+ * @sum : set if the crc32c of the output is computed
+ * @crc : crc32c of the bytes written to the output file so far
+ * @ubuf : user buffer the output goes to instead of a file, or NULL
+ * @ulen : size of @ubuf
+ * @ufilled : bytes of @ubuf filled so far
+ * @full : set once a line did not fit in what is left of @ubuf
+ * @limit : number of lines after which the merge stops, 0 for no limit
+ * @stop : set once the merge has to stop early, @ubuf is full or the
+ * line limit is reached
+ * @wbchunk : bytes of output between writeback starts, 0 for none
+ * @wbpos : offset up to which writeback was started
+ * @shard : outputs lines are routed to if the output is sharded, NULL
+ * otherwise
+ * @restart : lines between restart points if the output is front coded,
+ * 0 for plain lines
  */
 typedef struct outbuffer {
 	char *buffer;
 	unsigned int currsize;
 	unsigned int availsize;
+	struct z_stream_s *zstrm;
+	char *zbuf;
+	int lines;
+	struct ckptstate *ckpt;
+	mergeprogress __user *progress;
+	struct inbuffer *src1;
+	struct inbuffer *src2;
+	struct idxstate *idx;
+	struct cryptstate *cs;
+	int sum;
+	u32 crc;
+	char __user *ubuf;
+	unsigned long long ulen;
+	unsigned long long ufilled;
+	int full;
+	unsigned int limit;
+	int stop;
+	loff_t wbchunk;
+	loff_t wbpos;
+	struct shardset *shard;
+	unsigned int restart;
 } outputbuf;
 
-/*
- * Structure to store input data in big chunks after file read
- * @buffer : char * to contain data
- * @start : start index in buffer
- * @size : current size of input buffer
- */
-typedef struct inbuffer {
-	char *buffer;
-	int start;
-	unsigned int size;
-} inputbuf;
+/*
+ * Outputs of a sharded merge, each with its own buffer and temp file
+ * @n : number of shards
+ * @hash : set if lines are routed by their crc32c, by @keys otherwise
+ * @insen : compare with @keys case insensitive
+ * @keys : @n - 1 ascending keys, shard k holds the lines from
+ * keys[k - 1] up to keys[k]
+ * @names : output file path of each shard
+ * @tmpnames : temp file path of each shard
+ * @filp : output files
+ * @temp : temp files the shards are written to
+ * @outbuf : output buffer of each shard, counting its lines
+ * @created : set if the output file of the shard was created by this merge
+ * @published : set once the temp file of the shard is renamed in place
+ */
+typedef struct shardset {
+	unsigned int n;
+	int hash;
+	int insen;
+	char *keys[XMERGE_MAX_SHARDS];
+	char *names[XMERGE_MAX_SHARDS];
+	char *tmpnames[XMERGE_MAX_SHARDS];
+	struct file *filp[XMERGE_MAX_SHARDS];
+	struct file *temp[XMERGE_MAX_SHARDS];
+	outputbuf outbuf[XMERGE_MAX_SHARDS];
+	int created[XMERGE_MAX_SHARDS];
+	int published[XMERGE_MAX_SHARDS];
+} shardset;
+
+/*
+ * Structure to store input data in big chunks after file read
+ * @buffer : char * to contain data
+ * @start : start index in buffer
+ * @size : current size of input buffer
+ * @zstrm : inflate stream if the file is compressed, NULL otherwise
+ * @zbuf : compressed bytes read from the file, not yet inflated
+ * @zend : set once the compressed stream is finished
+ * @consumed : bytes of the file handed out as lines so far
+ * @eof : set once file_line_read reached the end of the file
+ * @linebuf : scratch space used by file_line_read to assemble a line
+ * @hikey : lines from this key on are treated as end of file, or NULL
+ * @insen : compare with @hikey case insensitive
+ * @cs : cipher state if the file is encrypted, NULL otherwise
+ * @pgread : set if lines are read from the page cache, see page_line_read
+ * @page : page cache page currently read, NULL if none
+ * @kaddr : kernel mapping of @page
+ * @fc : set if the file is front coded, @linebuf then keeps the last
+ * line decoded, see fc_line_read
+ * @fclen : length of the last line decoded
+ */
+typedef struct inbuffer {
+	char *buffer;
+	char *linebuf;
+	int start;
+	unsigned int size;
+	struct z_stream_s *zstrm;
+	char *zbuf;
+	int zend;
+	loff_t consumed;
+	int eof;
+	char *hikey;
+	int insen;
+	struct cryptstate *cs;
+	int pgread;
+	struct page *page;
+	char *kaddr;
+	int fc;
+	unsigned int fclen;
+} inputbuf;
+
+/*
+ * Checkpoint record, stored at the start of a slot of the checkpoint file
+ * and followed by @lastlen bytes of the last line written to output
+ * @magic : CKPT_MAGIC
+ * @flags : merge flags the checkpoint was taken with
+ * @inpos1, @inpos2 : offset of the first line of each input not merged yet
+ * @outpos : size of the output written so far
+ * @count : number of lines written so far
+ * @lastlen : length of the last line written to output
+ * @crc : crc32c of the record, with @crc 0, and of the last line
+ */
+typedef struct ckptrec {
+	unsigned int magic;
+	unsigned int flags;
+	loff_t inpos1;
+	loff_t inpos2;
+	loff_t outpos;
+	int count;
+	unsigned int lastlen;
+	u32 crc;
+} ckptrec;
+
+/*
+ * Structure holding what is needed to take a checkpoint during a flush
+ * @filp : checkpoint file
+ * @inputbuf1, @inputbuf2 : chunk buffers of the inputs
+ * @inbuf1, @inbuf2 : where the current line of each input is, the line
+ * buffers move around as lines are written, see file_line_write
+ * @flags : merge flags
+ * @lastpos : output size at the last checkpoint
+ * @slot : slot the next checkpoint is written to
+ */
+typedef struct ckptstate {
+	struct file *filp;
+	inputbuf *inputbuf1;
+	inputbuf *inputbuf2;
+	char **inbuf1;
+	char **inbuf2;
+	unsigned int flags;
+	loff_t lastpos;
+	int slot;
+} ckptstate;
+
+/*
+ * Structure holding the sparse index while it is written
+ * @filp : index file
+ * @stride : lines between two entries
+ * @entries : entries recorded so far
+ * @ents : entries not written to the file yet
+ * @nents : number of entries in @ents
+ * @pos : write position in the index file
+ */
+typedef struct idxstate {
+	struct file *filp;
+	unsigned int stride;
+	unsigned long long entries;
+	xidxent *ents;
+	int nents;
+	loff_t pos;
+} idxstate;
+
+/*
+ * Merge context, all the memory one call of xmergesort needs.
+ * Contexts are preallocated at module load and reused across calls
+ * @finput : argument structure copied from user
+ * @inbuf1, @inbuf2 : current line of each input
+ * @lastout : last line written to output
+ * @outbuf : output buffer
+ * @inputbuf1, @inputbuf2 : chunk buffers of each input
+ * @list : link in the pool of free contexts
+ */
+typedef struct mergectx {
+	fileinput finput;
+	char *inbuf1;
+	char *inbuf2;
+	char *lastout;
+	outputbuf outbuf;
+	inputbuf inputbuf1;
+	inputbuf inputbuf2;
+	struct list_head list;
+} mergectx;
+
+/*
+ * pool of free merge contexts
+ */
+static LIST_HEAD(ctx_pool);
+static DEFINE_SPINLOCK(ctx_pool_lock);
+static int ctx_pool_count;
+
+/*
+ * ctx_free : release a merge context and all its buffers
+ */
+static void
+ctx_free(mergectx *ctx) {
+	if (ctx == NULL)
+		return;
+	kfree(ctx->inbuf1);
+	kfree(ctx->inbuf2);
+	kfree(ctx->lastout);
+	kfree(ctx->outbuf.buffer);
+	kfree(ctx->inputbuf1.buffer);
+	kfree(ctx->inputbuf1.linebuf);
+	kfree(ctx->inputbuf2.buffer);
+	kfree(ctx->inputbuf2.linebuf);
+	kfree(ctx);
+}
+
+/*
+ * ctx_alloc : allocate a merge context and all its buffers
+ * returns the context, NULL if memory allocation failed
+ */
+static mergectx *
+ctx_alloc(void) {
+	mergectx *ctx;
+
+	ctx = (mergectx *) kzalloc(sizeof(mergectx), GFP_KERNEL);
+	if (ctx == NULL)
+		return NULL;
+	ctx->inbuf1 = (char *) kmalloc(PAGE_SIZE, GFP_KERNEL);
+	ctx->inbuf2 = (char *) kmalloc(PAGE_SIZE, GFP_KERNEL);
+	ctx->lastout = (char *) kmalloc(PAGE_SIZE, GFP_KERNEL);
+	ctx->outbuf.buffer = (char *) kmalloc(MAX_OUTBUF_SIZE, GFP_KERNEL);
+	ctx->inputbuf1.buffer = (char *) kmalloc(MAX_INBUF_SIZE, GFP_KERNEL);
+	ctx->inputbuf1.linebuf = (char *) kmalloc(PAGE_SIZE, GFP_KERNEL);
+	ctx->inputbuf2.buffer = (char *) kmalloc(MAX_INBUF_SIZE, GFP_KERNEL);
+	ctx->inputbuf2.linebuf = (char *) kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!ctx->inbuf1 || !ctx->inbuf2 || !ctx->lastout
+	    || !ctx->outbuf.buffer || !ctx->inputbuf1.buffer
+	    || !ctx->inputbuf1.linebuf || !ctx->inputbuf2.buffer
+	    || !ctx->inputbuf2.linebuf) {
+		ctx_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+/*
+ * ctx_reset_input : bring an input buffer back to its empty state,
+ * keeping the memory it owns
+ */
+static void
+ctx_reset_input(inputbuf *inbuf) {
+	char *buffer = inbuf->buffer;
+	char *linebuf = inbuf->linebuf;
+
+	memset(inbuf, 0, sizeof(inputbuf));
+	inbuf->buffer = buffer;
+	inbuf->linebuf = linebuf;
+	inbuf->start = -1; /*-1 indicate buffer is empty*/
+}
+
+/*
+ * ctx_get : take a merge context from the pool, or allocate a new one
+ * if the pool is empty. The context is reset for a new merge
+ * returns the context, NULL if memory allocation failed
+ */
+static mergectx *
+ctx_get(void) {
+	mergectx *ctx = NULL;
+	char *buffer;
+
+	spin_lock(&ctx_pool_lock);
+	if (!list_empty(&ctx_pool)) {
+		ctx = list_first_entry(&ctx_pool, mergectx, list);
+		list_del(&ctx->list);
+		ctx_pool_count--;
+	}
+	spin_unlock(&ctx_pool_lock);
+
+	if (ctx == NULL) {
+		ctx = ctx_alloc();
+		if (ctx == NULL)
+			return NULL;
+	}
+
+	memset(&ctx->finput, 0, sizeof(fileinput));
+	ctx->lastout[0] = '\0';
+	buffer = ctx->outbuf.buffer;
+	memset(&ctx->outbuf, 0, sizeof(outputbuf));
+	ctx->outbuf.buffer = buffer;
+	ctx->outbuf.availsize = MAX_OUTBUF_SIZE;
+	ctx_reset_input(&ctx->inputbuf1);
+	ctx_reset_input(&ctx->inputbuf2);
+	return ctx;
+}
+
+/*
+ * ctx_put : give a merge context back to the pool, it is freed if the
+ * pool is already full
+ */
+static void
+ctx_put(mergectx *ctx) {
+	if (ctx == NULL)
+		return;
+	spin_lock(&ctx_pool_lock);
+	if (ctx_pool_count < ctx_pool_size) {
+		list_add(&ctx->list, &ctx_pool);
+		ctx_pool_count++;
+		ctx = NULL;
+	}
+	spin_unlock(&ctx_pool_lock);
+	ctx_free(ctx);
+}
+
+/*
+ * cipher_setup : key the transform of an encrypted merge
+ * @cs : cipher state, zeroed
+ * @key : MD5_KEY_LENGTH bytes of key
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+cipher_setup(cryptstate *cs, unsigned char *key) {
+	struct crypto_blkcipher *tfm;
+	int err;
+
+	cs->scratch = kmalloc(CIPHER_SCRATCH_SIZE, GFP_KERNEL);
+	if (cs->scratch == NULL)
+		return -ENOMEM;
+	tfm = crypto_alloc_blkcipher("ctr(aes)", 0, 0);
+	if (IS_ERR(tfm)) {
+		printk(KERN_ERR "failed to load ctr(aes) transform\n");
+		return PTR_ERR(tfm);
+	}
+	cs->desc.tfm = tfm;
+	cs->desc.flags = 0;
+	err = crypto_blkcipher_setkey(tfm, key, MD5_KEY_LENGTH);
+	if (err)
+		return err;
+	sha(cs->preamble, key);
+	return 0;
+}
+
+/*
+ * cipher_release : release the transform and scratch of an encrypted merge
+ */
+static void
+cipher_release(cryptstate *cs) {
+	if (cs == NULL)
+		return;
+	if (cs->desc.tfm)
+		crypto_free_blkcipher(cs->desc.tfm);
+	kfree(cs->scratch);
+	kfree(cs);
+}
+
+/*
+ * cipher_apply : encrypt or decrypt data in place, both are the same in CTR
+ * @cs : cipher state
+ * @buf : data
+ * @offset : offset of @buf in the encrypted data, after the preamble
+ * @len : bytes of data
+ *
+ * the counter is derived from @offset, so the data does not have to start
+ * on an AES block. The part of the first block before @buf is padded in
+ * the scratch space and thrown away
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+cipher_apply(cryptstate *cs, char *buf, loff_t offset, unsigned int len) {
+	struct scatterlist sg;
+	u8 iv[CRYPT_IV_SIZE];
+	unsigned int lead = offset & (CRYPT_IV_SIZE - 1);
+	unsigned int n;
+	int err;
+
+	while (len > 0) {
+		n = min_t(unsigned int, len, CIPHER_SCRATCH_SIZE - lead);
+		memset(cs->scratch, 0, lead);
+		memcpy(cs->scratch + lead, buf, n);
+		ctr_iv_at(iv, offset - lead);
+		crypto_blkcipher_set_iv(cs->desc.tfm, iv, CRYPT_IV_SIZE);
+		sg_init_one(&sg, cs->scratch, lead + n);
+		err = crypto_blkcipher_encrypt(&cs->desc, &sg, &sg, lead + n);
+		if (err)
+			return err;
+		memcpy(buf, cs->scratch + lead, n);
+		buf += n;
+		offset += n;
+		len -= n;
+		lead = 0;
+	}
+	return 0;
+}
+
+/*
+ * cipher_read : vfs_read at the file position, decrypting what was read
+ * @filp : file to read, the caller has set KERNEL_DS
+ * @cs : cipher state, NULL if the file is not encrypted
+ *
+ * returns number of bytes read, -ve in case of error
+ */
+static int
+cipher_read(struct file *filp, cryptstate *cs, char *buf, size_t len) {
+	loff_t offset = filp->f_pos - SHA_KEY_LENGTH;
+	int err;
+	int ret;
+
+	err = vfs_read(filp, buf, len, &filp->f_pos);
+	if (err > 0 && cs) {
+		ret = cipher_apply(cs, buf, offset, err);
+		if (ret < 0)
+			return ret;
+	}
+	return err;
+}
+
+/*
+ * cipher_write : vfs_write at the file position, encrypting the data
+ * first. The data is encrypted in place
+ * @filp : file to write, the caller has set KERNEL_DS
+ * @cs : cipher state, NULL if the file is not encrypted
+ *
+ * returns number of bytes written, -ve in case of error
+ */
+static int
+cipher_write(struct file *filp, cryptstate *cs, char *buf, size_t len) {
+	int err;
+
+	if (cs) {
+		err = cipher_apply(cs, buf, filp->f_pos - SHA_KEY_LENGTH, len);
+		if (err < 0)
+			return err;
+	}
+	return vfs_write(filp, buf, len, &filp->f_pos);
+}
+
+/*
+ * cipher_check : check the preamble of an encrypted input against the
+ * key, and leave the file at the start of the encrypted data
+ * @filp : input file
+ * @inbuf : input buffer of the file
+ * @cs : cipher state
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+cipher_check(struct file *filp, inputbuf *inbuf, cryptstate *cs) {
+	mm_segment_t oldfs;
+	unsigned char preamble[SHA_KEY_LENGTH];
+	loff_t pos = 0;
+	int err;
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	err = vfs_read(filp, preamble, SHA_KEY_LENGTH, &pos);
+	set_fs(oldfs);
+	if (err < 0)
+		return err;
+	if (err != SHA_KEY_LENGTH
+	    || memcmp(preamble, cs->preamble, SHA_KEY_LENGTH) != 0) {
+		printk(KERN_ERR "input is not encrypted with this key\n");
+		return -EINVAL;
+	}
+	filp->f_pos = SHA_KEY_LENGTH;
+	inbuf->consumed = SHA_KEY_LENGTH;
+	inbuf->cs = cs;
+	return 0;
+}
+
+/*
+ * cipher_preamble : start an encrypted output with the preamble of the key
+ * @filp : output file, positioned at its start
+ * @outbuf : output buffer
+ * @cs : cipher state
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+cipher_preamble(struct file *filp, outputbuf *outbuf, cryptstate *cs) {
+	mm_segment_t oldfs;
+	int err;
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	err = vfs_write(filp, cs->preamble, SHA_KEY_LENGTH, &filp->f_pos);
+	set_fs(oldfs);
+	if (err < 0)
+		return err;
+	if (err != SHA_KEY_LENGTH)
+		return -EIO;
+	if (outbuf->sum)
+		outbuf->crc = crc32c(outbuf->crc, cs->preamble, SHA_KEY_LENGTH);
+	outbuf->cs = cs;
+	return 0;
+}
+
+/*
+ * zstream_free : release a zlib stream and its workspace
+ */
+static void
+zstream_free(struct z_stream_s *zstrm) {
+	if (zstrm == NULL)
+		return;
+	if (zstrm->workspace)
+		vfree(zstrm->workspace);
+	kfree(zstrm);
+}
+
+/*
+ * zinput_detect : check if the input file is compressed and set up inflate
+ * @filp : input file
+ * @inbuf : input buffer of the file
+ *
+ * gzip and zlib streams are recognised by their header, anything else is
+ * read as plain text. zlib headers are only accepted with the binary flag
+ * bytes, so a text file can not be taken for one.
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+zinput_detect(struct file *filp, inputbuf *inbuf) {
+	mm_segment_t oldfs;
+	struct z_stream_s *zstrm = NULL;
+	unsigned char *hdr;
+	int len;
+	int skip = 0;
+	int wbits = 0;
+	int err = 0;
+
+	inbuf->zstrm = NULL;
+	inbuf->zbuf = NULL;
+	inbuf->zend = 0;
+
+	inbuf->zbuf = kmalloc(MAX_INBUF_SIZE, GFP_KERNEL);
+	if (inbuf->zbuf == NULL)
+		return -ENOMEM;
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	len = cipher_read(filp, inbuf->cs, inbuf->zbuf, MAX_INBUF_SIZE);
+	set_fs(oldfs);
+	if (len < 0) {
+		err = len;
+		goto OUT_DETECT;
+	}
+
+	hdr = (unsigned char *) inbuf->zbuf;
+	if (len >= GZIP_HDR_SIZE && hdr[0] == GZIP_MAGIC1
+	    && hdr[1] == GZIP_MAGIC2 && hdr[2] == Z_DEFLATED) {
+		/* gzip member, skip the header and inflate the raw deflate data */
+		skip = GZIP_HDR_SIZE;
+		if ((hdr[3] & GZIP_FEXTRA) != 0 && skip + 2 <= len)
+			skip += 2 + (hdr[skip] | (hdr[skip + 1] << 8));
+		if ((hdr[3] & GZIP_FNAME) != 0)
+			while (skip < len && hdr[skip++] != 0)
+				;
+		if ((hdr[3] & GZIP_FCOMMENT) != 0)
+			while (skip < len && hdr[skip++] != 0)
+				;
+		if ((hdr[3] & GZIP_FHCRC) != 0)
+			skip += 2;
+		if (skip >= len) {
+			printk(KERN_ERR "gzip header too long\n");
+			err = -EINVAL;
+			goto OUT_DETECT;
+		}
+		wbits = -MAX_WBITS;
+	} else if (len >= 2 && hdr[0] == ZLIB_MAGIC
+		   && (hdr[1] == 0x01 || hdr[1] == 0x9c || hdr[1] == 0xda)) {
+		wbits = MAX_WBITS;
+	}
+
+	if (wbits == 0) {
+		/* plain text, read it again from the start of the data */
+		filp->f_pos = inbuf->cs ? SHA_KEY_LENGTH : 0;
+		kfree(inbuf->zbuf);
+		inbuf->zbuf = NULL;
+		return 0;
+	}
+
+	zstrm = kzalloc(sizeof(struct z_stream_s), GFP_KERNEL);
+	if (zstrm == NULL) {
+		err = -ENOMEM;
+		goto OUT_DETECT;
+	}
+	zstrm->workspace = vmalloc(zlib_inflate_workspacesize());
+	if (zstrm->workspace == NULL) {
+		err = -ENOMEM;
+		goto OUT_DETECT;
+	}
+	if (zlib_inflateInit2(zstrm, wbits) != Z_OK) {
+		err = -EINVAL;
+		goto OUT_DETECT;
+	}
+	zstrm->next_in = hdr + skip;
+	zstrm->avail_in = len - skip;
+	inbuf->zstrm = zstrm;
+	return 0;
+
+OUT_DETECT:
+	zstream_free(zstrm);
+	kfree(inbuf->zbuf);
+	inbuf->zbuf = NULL;
+	return err;
+}
+
+/*
+ * zinput_release : release the inflate state of an input buffer
+ */
+static void
+zinput_release(inputbuf *inbuf) {
+	if (inbuf == NULL)
+		return;
+	if (inbuf->zstrm) {
+		zlib_inflateEnd(inbuf->zstrm);
+		zstream_free(inbuf->zstrm);
+		inbuf->zstrm = NULL;
+	}
+	if (inbuf->zbuf) {
+		kfree(inbuf->zbuf);
+		inbuf->zbuf = NULL;
+	}
+}
+
+/*
+ * zoutput_setup : set up deflate for the output buffer
+ * @outbuf : output buffer
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+zoutput_setup(outputbuf *outbuf) {
+	struct z_stream_s *zstrm;
+
+	outbuf->zbuf = kmalloc(MAX_OUTBUF_SIZE, GFP_KERNEL);
+	if (outbuf->zbuf == NULL)
+		return -ENOMEM;
+	zstrm = kzalloc(sizeof(struct z_stream_s), GFP_KERNEL);
+	if (zstrm == NULL)
+		return -ENOMEM;
+	outbuf->zstrm = zstrm;
+	zstrm->workspace = vmalloc(zlib_deflate_workspacesize(MAX_WBITS, MAX_MEM_LEVEL));
+	if (zstrm->workspace == NULL)
+		return -ENOMEM;
+	if (zlib_deflateInit2(zstrm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			      MAX_WBITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * zoutput_release : release the deflate state of the output buffer
+ */
+static void
+zoutput_release(outputbuf *outbuf) {
+	if (outbuf == NULL)
+		return;
+	if (outbuf->zstrm) {
+		if (outbuf->zstrm->workspace)
+			zlib_deflateEnd(outbuf->zstrm);
+		zstream_free(outbuf->zstrm);
+		outbuf->zstrm = NULL;
+	}
+	if (outbuf->zbuf) {
+		kfree(outbuf->zbuf);
+		outbuf->zbuf = NULL;
+	}
+}
+
+/*
+ * output_write : write bytes of the output file, in the form they take
+ * on disk, folding them into the checksum of the output
+ * @filp : output file, the caller has set KERNEL_DS
+ * @outbuf : output buffer
+ *
+ * returns number of bytes written, -ve in case of error
+ */
+static int
+output_write(struct file *filp, outputbuf *outbuf, char *buf, size_t len) {
+	int err;
+
+	err = cipher_write(filp, outbuf->cs, buf, len);
+	if (err > 0 && outbuf->sum)
+		outbuf->crc = crc32c(outbuf->crc, buf, err);
+	/*
+	 * start writeback of what was written since the last start, without
+	 * waiting for it, so the sync at the end has little left to do
+	 */
+	if (err > 0 && outbuf->wbchunk
+	    && filp->f_pos - outbuf->wbpos >= outbuf->wbchunk) {
+		filemap_fdatawrite_range(filp->f_mapping, outbuf->wbpos,
+					 filp->f_pos - 1);
+		outbuf->wbpos = filp->f_pos;
+	}
+	return err;
+}
+
+/*
+ * checksum_prefix : fold the part of the output written before a resume
+ * into the checksum
+ * @filp : output file, positioned where the merge continues
+ * @outbuf : output buffer, its empty buffer is used to read the file
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+checksum_prefix(struct file *filp, outputbuf *outbuf) {
+	mm_segment_t oldfs;
+	loff_t pos = 0;
+	int err = 0;
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	while (pos < filp->f_pos) {
+		err = vfs_read(filp, outbuf->buffer,
+			       min_t(loff_t, MAX_OUTBUF_SIZE, filp->f_pos - pos), &pos);
+		if (err <= 0)
+			break;
+		outbuf->crc = crc32c(outbuf->crc, outbuf->buffer, err);
+	}
+	set_fs(oldfs);
+	if (err == 0 && pos < filp->f_pos)
+		err = -EIO;
+	return (err < 0) ? err : 0;
+}
+
+/*
+ * checksum_sidecar : write the checksum of the output next to it, in the
+ * "crc  path" form of the usual checksum tools
+ * @path : file path of the sidecar
+ * @crc : crc32c of the output
+ * @outfile : user pointer to the file path of the output
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+checksum_sidecar(char *path, u32 crc, char __user *outfile) {
+	mm_segment_t oldfs;
+	struct file *filp;
+	char *name;
+	char *line;
+	int len;
+	int err;
+
+	name = strndup_user(outfile, PAGE_SIZE);
+	if (IS_ERR(name))
+		return PTR_ERR(name);
+	line = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (line == NULL) {
+		kfree(name);
+		return -ENOMEM;
+	}
+	len = snprintf(line, PAGE_SIZE, "%08x  %s\n", crc, name);
+	kfree(name);
+	if (len >= PAGE_SIZE) {
+		kfree(line);
+		return -ENAMETOOLONG;
+	}
+	filp = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (!filp || IS_ERR(filp)) {
+		printk(KERN_ERR "open checksum FILE ERROR\n");
+		kfree(line);
+		return -EACCES;
+	}
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	err = vfs_write(filp, line, len, &filp->f_pos);
+	set_fs(oldfs);
+	filp_close(filp, NULL);
+	kfree(line);
+	if (err >= 0 && err != len)
+		err = -EIO;
+	return (err < 0) ? err : 0;
+}
+
+/*
+ * flush_out_buffer : write the content of the output buffer to the file
+ * @filp : file in which the buffer is written
+ * @outbuf : output buffer
+ * @final : set on the last flush, finishes the compressed stream
+ *
+ * if the output is compressed the block is fed to deflate and the
+ * compressed bytes are written instead, if it is encrypted whatever is
+ * written is encrypted in place first. The checksum of the output is
+ * taken over the bytes as they land in the file. A merge into a user
+ * buffer copies the block there instead
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+flush_out_buffer(struct file *filp, outputbuf *outbuf, int final) {
+	mm_segment_t oldfs;
+	struct z_stream_s *zstrm = outbuf->zstrm;
+	int zret;
+	int err = 0;
+
+	if (outbuf->ubuf) {
+		if (copy_to_user(outbuf->ubuf + outbuf->ufilled, outbuf->buffer,
+				 outbuf->currsize) != 0)
+			return -EFAULT;
+		outbuf->ufilled += outbuf->currsize;
+		return 0;
+	}
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	if (zstrm == NULL) {
+		err = output_write(filp, outbuf, outbuf->buffer, outbuf->currsize);
+		goto OUT_FLUSH;
+	}
+
+	zstrm->next_in = (unsigned char *) outbuf->buffer;
+	zstrm->avail_in = outbuf->currsize;
+	do {
+		zstrm->next_out = (unsigned char *) outbuf->zbuf;
+		zstrm->avail_out = MAX_OUTBUF_SIZE;
+		zret = zlib_deflate(zstrm, final ? Z_FINISH : Z_NO_FLUSH);
+		if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) {
+			err = -EIO;
+			goto OUT_FLUSH;
+		}
+		err = output_write(filp, outbuf, outbuf->zbuf,
+				   MAX_OUTBUF_SIZE - zstrm->avail_out);
+		if (err < 0)
+			goto OUT_FLUSH;
+	} while (zstrm->avail_out == 0 || (final && zret != Z_STREAM_END));
+
+OUT_FLUSH:
+	set_fs(oldfs);
+	return (err < 0) ? err : 0;
+}
+
+/*
+ * index_flush : write the buffered index entries to the index file
+ * returns 0 on success, -ve in case of error
+ */
+static int
+index_flush(idxstate *idx) {
+	mm_segment_t oldfs;
+	int err;
+
+	if (idx->nents == 0)
+		return 0;
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	err = vfs_write(idx->filp, (char *) idx->ents,
+			idx->nents * sizeof(xidxent), &idx->pos);
+	set_fs(oldfs);
+	idx->nents = 0;
+	return (err < 0) ? err : 0;
+}
+
+/*
+ * index_add : record a line of the output in the index
+ * @idx : index state
+ * @line : line being written
+ * @offset : offset of the line in the output file
+ * returns 0 on success, -ve in case of error
+ */
+static int
+index_add(idxstate *idx, char *line, loff_t offset) {
+	xidxent *ent = &idx->ents[idx->nents];
+	int k;
+
+	ent->offset = offset;
+	for (k = 0; k < XIDX_KEY_LEN && line[k] != '\0' && line[k] != '\n'; k++)
+		ent->key[k] = line[k];
+	for (; k < XIDX_KEY_LEN; k++)
+		ent->key[k] = '\0';
+	idx->entries++;
+	if (++idx->nents == IDX_BUF_ENTRIES)
+		return index_flush(idx);
+	return 0;
+}
+
+/*
+ * index_open : create the index file and reserve room for its header
+ * @idx : index state to set up
+ * @path : file path of the index
+ * @stride : lines between two entries
+ * returns 0 on success, -ve in case of error
+ */
+static int
+index_open(idxstate *idx, char *path, unsigned int stride) {
+	idx->filp = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (!idx->filp || IS_ERR(idx->filp)) {
+		printk(KERN_ERR "open index FILE ERROR\n");
+		idx->filp = NULL;
+		return -EACCES;
+	}
+	idx->ents = (xidxent *) kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (idx->ents == NULL)
+		return -ENOMEM;
+	idx->stride = stride;
+	idx->pos = sizeof(xidxhdr);
+	return 0;
+}
+
+/*
+ * index_finish : write the last entries and the header of the index
+ * @idx : index state
+ * @lines : number of lines in the output
+ * returns 0 on success, -ve in case of error
+ */
+static int
+index_finish(idxstate *idx, unsigned long long lines) {
+	mm_segment_t oldfs;
+	xidxhdr hdr;
+	loff_t pos = 0;
+	int err;
+
+	err = index_flush(idx);
+	if (err < 0)
+		return err;
+	hdr.magic = XIDX_MAGIC;
+	hdr.version = XIDX_VERSION;
+	hdr.stride = idx->stride;
+	hdr.keylen = XIDX_KEY_LEN;
+	hdr.entries = idx->entries;
+	hdr.lines = lines;
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	err = vfs_write(idx->filp, (char *) &hdr, sizeof(xidxhdr), &pos);
+	set_fs(oldfs);
+	return (err < 0) ? err : 0;
+}
+
+/*
+ * index_close : release the index state
+ */
+static void
+index_close(idxstate *idx) {
+	if (idx == NULL)
+		return;
+	if (idx->filp)
+		filp_close(idx->filp, NULL);
+	kfree(idx->ents);
+	kfree(idx);
+}
+
+/*
+ * progress_update : publish the progress of the merge to user memory
+ * @outbuf : output buffer
+ * @filp : output file
+ * @done : set once the merge is finished
+ *
+ * returns 0 on success, -EFAULT if user memory is not writable
+ */
+static int
+progress_update(outputbuf *outbuf, struct file *filp, unsigned int done) {
+	mergeprogress prog;
+
+	if (outbuf->progress == NULL)
+		return 0;
+	prog.in1_bytes = outbuf->src1->consumed;
+	prog.in2_bytes = outbuf->src2->consumed;
+	prog.out_bytes = filp->f_pos;
+	prog.lines = outbuf->lines;
+	prog.done = done;
+	if (copy_to_user(outbuf->progress, &prog, sizeof(mergeprogress)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * file_truncate : set the size of an open file, as ftruncate does
+ * @filp : file opened for writing
+ * @len : new size
+ *
+ * unlike vfs_truncate the permission to write is the one the file was
+ * opened with, the mode of the file is not checked again
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+file_truncate(struct file *filp, loff_t len) {
+	struct dentry *dentry = filp->f_path.dentry;
+	struct inode *inode = dentry->d_inode;
+	struct iattr newattrs;
+	int err;
+
+	newattrs.ia_size = len;
+	newattrs.ia_valid = ATTR_SIZE | ATTR_MTIME | ATTR_CTIME | ATTR_FILE;
+	newattrs.ia_file = filp;
+	sb_start_write(inode->i_sb);
+	mutex_lock(&inode->i_mutex);
+	err = notify_change(dentry, &newattrs, NULL);
+	mutex_unlock(&inode->i_mutex);
+	sb_end_write(inode->i_sb);
+	return err;
+}
+
+/*
+ * ckpt_crc : checksum of a checkpoint record and its last line
+ */
+static u32
+ckpt_crc(ckptrec *rec, char *lastout) {
+	u32 saved = rec->crc;
+	u32 crc;
+
+	rec->crc = 0;
+	crc = crc32c(~0, rec, sizeof(ckptrec));
+	crc = crc32c(crc, lastout, rec->lastlen);
+	rec->crc = saved;
+	return crc;
+}
+
+/*
+ * ckpt_pending_pos : offset of the first line of an input not merged yet
+ * @inbuf : chunk buffer of the input
+ * @line : current line of the input
+ */
+static loff_t
+ckpt_pending_pos(inputbuf *inbuf, char *line) {
+	if (inbuf->eof)
+		return inbuf->consumed;
+	return inbuf->consumed - strlen(line);
+}
+
+/*
+ * ckpt_write : record the state of the merge right after a flush
+ * @ckpt : checkpoint state
+ * @filp : output file, fully flushed
+ * @outbuf : output buffer, empty at this point
+ * @lastout : last line written to output
+ *
+ * a checkpoint is taken every ckpt_mb MiB of output. The output is
+ * synced first, so a checkpoint never points past data that could be
+ * lost in a crash, and the record is synced once written to its slot
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+ckpt_write(ckptstate *ckpt, struct file *filp, outputbuf *outbuf, char *lastout) {
+	mm_segment_t oldfs;
+	ckptrec rec;
+	loff_t pos = CKPT_SLOT(ckpt->slot);
+	int err;
+
+	if (filp->f_pos - ckpt->lastpos < ((loff_t) ckpt_mb << 20))
+		return 0;
+	ckpt->lastpos = filp->f_pos;
+
+	err = vfs_fsync(filp, 1);
+	if (err < 0)
+		return err;
+
+	memset(&rec, 0, sizeof(ckptrec));
+	rec.magic = CKPT_MAGIC;
+	rec.flags = ckpt->flags & ~(F_CHECKPOINT | F_RESUME);
+	rec.inpos1 = ckpt_pending_pos(ckpt->inputbuf1, *ckpt->inbuf1);
+	rec.inpos2 = ckpt_pending_pos(ckpt->inputbuf2, *ckpt->inbuf2);
+	rec.outpos = filp->f_pos;
+	rec.count = outbuf->lines;
+	rec.lastlen = strlen(lastout);
+	rec.crc = ckpt_crc(&rec, lastout);
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	err = vfs_write(ckpt->filp, (char *) &rec, sizeof(ckptrec), &pos);
+	if (err >= 0)
+		err = vfs_write(ckpt->filp, lastout, rec.lastlen, &pos);
+	set_fs(oldfs);
+	if (err >= 0)
+		err = vfs_fsync(ckpt->filp, 1);
+	if (err < 0)
+		return err;
+	ckpt->slot ^= 1;
+	return 0;
+}
+
+/*
+ * ckpt_read_slot : read a checkpoint record and check it is whole
+ * @ckpt : checkpoint state
+ * @slot : slot to read
+ * @rec : filled with the record
+ * @lastout : filled with the last line of the record
+ *
+ * returns 1 if the slot holds a whole record of this merge, 0 if not,
+ * -ve in case of error
+ */
+static int
+ckpt_read_slot(ckptstate *ckpt, int slot, ckptrec *rec, char *lastout) {
+	mm_segment_t oldfs;
+	loff_t pos = CKPT_SLOT(slot);
+	int err;
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	err = vfs_read(ckpt->filp, (char *) rec, sizeof(ckptrec), &pos);
+	if (err == sizeof(ckptrec) && rec->lastlen < PAGE_SIZE)
+		err = vfs_read(ckpt->filp, lastout, rec->lastlen, &pos);
+	set_fs(oldfs);
+	if (err < 0)
+		return err;
+	if (rec->magic != CKPT_MAGIC || rec->lastlen >= PAGE_SIZE
+	    || err != rec->lastlen || rec->crc != ckpt_crc(rec, lastout)
+	    || rec->flags != (ckpt->flags & ~(F_CHECKPOINT | F_RESUME)))
+		return 0;
+	lastout[rec->lastlen] = '\0';
+	return 1;
+}
+
+/*
+ * ckpt_resume : restore the state of a merge from its checkpoint
+ * @ckpt : checkpoint state
+ * @file_in1, @file_in2 : input files, repositioned to the first pending line
+ * @filp : temp output file, cut back to the checkpointed size
+ * @outbuf : output buffer
+ * @lastout : filled with the last line written to output
+ *
+ * returns number of lines already written, -ve in case of error
+ */
+static int
+ckpt_resume(ckptstate *ckpt, struct file *file_in1, struct file *file_in2,
+	    struct file *filp, outputbuf *outbuf, char *lastout) {
+	ckptrec rec;
+	ckptrec other;
+	char *line;
+	int ok;
+	int err;
+
+	line = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (line == NULL)
+		return -ENOMEM;
+
+	/* the newest whole record of the two slots is resumed from */
+	ok = ckpt_read_slot(ckpt, 0, &rec, lastout);
+	err = ckpt_read_slot(ckpt, 1, &other, line);
+	if (ok < 0 || err < 0) {
+		kfree(line);
+		return (ok < 0) ? ok : err;
+	}
+	ckpt->slot = 1;
+	if (err > 0 && (ok == 0 || other.outpos > rec.outpos)) {
+		rec = other;
+		memcpy(lastout, line, rec.lastlen + 1);
+		ckpt->slot = 0;
+		ok = 1;
+	}
+	kfree(line);
+
+	if (ok == 0 || rec.outpos > i_size_read(file_inode(filp))) {
+		printk(KERN_ERR "checkpoint does not match this merge\n");
+		return -EINVAL;
+	}
+	ckpt->lastpos = rec.outpos;
+
+	/* drop whatever was written after the checkpoint was taken */
+	err = file_truncate(filp, rec.outpos);
+	if (err < 0)
+		return err;
+	filp->f_pos = rec.outpos;
+	file_in1->f_pos = rec.inpos1;
+	file_in2->f_pos = rec.inpos2;
+	ckpt->inputbuf1->consumed = rec.inpos1;
+	ckpt->inputbuf2->consumed = rec.inpos2;
+	outbuf->lines = rec.count;
+	return rec.count;
+}
+
+/*
+ * cont_resume : pick a merge into a user buffer up where the last call
+ * stopped
+ * @cont : continuation copied from user
+ * @file_in1, @file_in2 : input files, repositioned to the first pending line
+ * @inputbuf1, @inputbuf2 : chunk buffers of the inputs
+ * @outbuf : output buffer
+ * @lastout : filled with the last line output
+ *
+ * returns number of lines already output, -ve in case of error
+ */
+static int
+cont_resume(mergecont *cont, struct file *file_in1, struct file *file_in2,
+	    inputbuf *inputbuf1, inputbuf *inputbuf2, outputbuf *outbuf,
+	    char *lastout) {
+	if (inputbuf1->zstrm || inputbuf2->zstrm) {
+		printk(KERN_ERR "can not continue a merge of compressed input\n");
+		return -EINVAL;
+	}
+	if (cont->inpos1 < 0 || cont->inpos2 < 0)
+		return -EINVAL;
+	file_in1->f_pos = cont->inpos1;
+	file_in2->f_pos = cont->inpos2;
+	inputbuf1->consumed = cont->inpos1;
+	inputbuf2->consumed = cont->inpos2;
+	cont->last[XMERGE_LAST_LEN - 1] = '\0';
+	strlcpy(lastout, cont->last, PAGE_SIZE);
+	outbuf->lines = cont->lines;
+	return cont->lines;
+}
+
+/*
+ * cont_finish : record where a merge into a user buffer stopped
+ * @cont : continuation, copied back to user by the caller
+ * @inputbuf1, @inputbuf2 : chunk buffers of the inputs
+ * @inbuf1, @inbuf2 : current line of each input
+ * @outbuf : output buffer, flushed
+ * @lastout : last line output
+ *
+ * returns 0 on success, -EOVERFLOW if not even one line fits the buffer
+ */
+static int
+cont_finish(mergecont *cont, inputbuf *inputbuf1, char *inbuf1,
+	    inputbuf *inputbuf2, char *inbuf2, outputbuf *outbuf,
+	    char *lastout) {
+	if (outbuf->full && outbuf->ufilled == 0)
+		return -EOVERFLOW;
+	cont->filled = outbuf->ufilled;
+	cont->more = outbuf->full;
+	cont->inpos1 = ckpt_pending_pos(inputbuf1, inbuf1);
+	cont->inpos2 = ckpt_pending_pos(inputbuf2, inbuf2);
+	cont->lines = outbuf->lines;
+	strlcpy(cont->last, lastout, XMERGE_LAST_LEN);
+	return 0;
+}
+
+/*
+ * fc_put : store a varint of a front coded line
+ * @p : filled with the varint, at most 5 bytes
+ * @v : value to store
+ * returns number of bytes stored
+ */
+static int
+fc_put(unsigned char *p, unsigned int v) {
+	int n = 0;
+
+	do {
+		p[n] = v & 0x7f;
+		v >>= 7;
+		if (v)
+			p[n] |= 0x80;
+		n++;
+	} while (v);
+	return n;
+}
+
+/*
+ * shard_pick : shard a line is written to
+ * @sh : shards of the output
+ * @line : the line, with its newline
+ * @len : length of @line
+ *
+ * range shards are binary searched for the first key above the line, a
+ * line equal to a key opens the shard of that key. Hash shards use the
+ * crc32c of the line, so the same line lands in the same shard on every
+ * merge. Case insensitive merges hash the lower cased line, lines that
+ * only differ in case must meet in one shard to be merged as one
+ */
+static unsigned int
+shard_pick(shardset *sh, char *line, int len) {
+	unsigned int lo = 0;
+	unsigned int hi = sh->n - 1;
+	unsigned int mid;
+	char fold[64];
+	u32 crc = 0;
+	int i;
+	int j;
+	int n;
+
+	if (sh->hash && !sh->insen)
+		return crc32c(0, line, len) % sh->n;
+	if (sh->hash) {
+		for (i = 0; i < len; i += n) {
+			n = min_t(int, len - i, sizeof(fold));
+			for (j = 0; j < n; j++)
+				fold[j] = tolower(line[i + j]);
+			crc = crc32c(crc, fold, n);
+		}
+		return crc % sh->n;
+	}
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((sh->insen ? strcasecmp(line, sh->keys[mid])
+		     : strcmp(line, sh->keys[mid])) >= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * file_unlink : remove a file the merge opened
+ * @filp : the file
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+file_unlink(struct file *filp) {
+	struct dentry *dir = filp->f_path.dentry->d_parent;
+	int err;
+
+	mutex_lock_nested(&dir->d_inode->i_mutex, I_MUTEX_PARENT);
+	err = vfs_unlink(dir->d_inode, filp->f_path.dentry, NULL);
+	mutex_unlock(&dir->d_inode->i_mutex);
+	return err;
+}
+
+/*
+ * shard_release : close and free the shards, also after a partial setup
+ * @sh : shards, may be NULL
+ *
+ * the temp files of shards not published, and the outputs this merge
+ * created for them, are removed so a failed merge leaves nothing behind
+ */
+static void
+shard_release(shardset *sh) {
+	unsigned int k;
+
+	if (sh == NULL)
+		return;
+	for (k = 0; k < XMERGE_MAX_SHARDS; k++) {
+		if (!sh->published[k]) {
+			if (sh->temp[k])
+				file_unlink(sh->temp[k]);
+			if (sh->filp[k] && sh->created[k])
+				file_unlink(sh->filp[k]);
+		}
+		if (sh->filp[k])
+			filp_close(sh->filp[k], NULL);
+		if (sh->temp[k])
+			filp_close(sh->temp[k], NULL);
+		kfree(sh->outbuf[k].buffer);
+		kfree(sh->keys[k]);
+		kfree(sh->names[k]);
+		kfree(sh->tmpnames[k]);
+	}
+	kfree(sh);
+}
+
+/*
+ * shard_setup : open the outputs of a sharded merge
+ * @sh : zeroed shards to set up
+ * @finput : arguments of the merge
+ * @outname : output path, shard k is written to outname.k
+ * @file_in1, @file_in2 : input files
+ *
+ * returns 0 on success, -ve in case of error, @sh is then released by
+ * shard_release as it is
+ */
+static int
+shard_setup(shardset *sh, fileinput *finput, char *outname,
+	    struct file *file_in1, struct file *file_in2) {
+	char __user *ukeys[XMERGE_MAX_SHARDS];
+	unsigned int k;
+	int err;
+
+	sh->n = finput->shards;
+	sh->hash = (finput->flags & F_SHARD_HASH) != 0;
+	sh->insen = (finput->flags & F_CASE_INSEN) != 0;
+
+	if (!sh->hash) {
+		if (copy_from_user(ukeys, finput->shardkeys,
+				   (sh->n - 1) * sizeof(char *)) != 0)
+			return -EFAULT;
+		for (k = 0; k < sh->n - 1; k++) {
+			sh->keys[k] = strndup_user(ukeys[k], PAGE_SIZE);
+			if (IS_ERR(sh->keys[k])) {
+				err = PTR_ERR(sh->keys[k]);
+				sh->keys[k] = NULL;
+				return err;
+			}
+			/*keys have to be ascending for the binary search*/
+			if (k > 0 && (sh->insen ? strcasecmp(sh->keys[k - 1], sh->keys[k])
+				      : strcmp(sh->keys[k - 1], sh->keys[k])) >= 0)
+				return -EINVAL;
+		}
+	}
+
+	for (k = 0; k < sh->n; k++) {
+		sh->names[k] = kasprintf(GFP_KERNEL, "%s.%u", outname, k);
+		sh->tmpnames[k] = kasprintf(GFP_KERNEL, "%s.%u.tmp", outname, k);
+		sh->outbuf[k].buffer = kmalloc(MAX_OUTBUF_SIZE, GFP_KERNEL);
+		if (!sh->names[k] || !sh->tmpnames[k] || !sh->outbuf[k].buffer)
+			return -ENOMEM;
+		sh->outbuf[k].availsize = MAX_OUTBUF_SIZE;
+		if ((finput->flags & F_WRITEBACK) != 0 && writeback_kb > 0)
+			sh->outbuf[k].wbchunk = (loff_t) writeback_kb << 10;
+
+		sh->temp[k] = filp_open(sh->tmpnames[k], O_WRONLY | O_CREAT | O_TRUNC, 0);
+		sh->filp[k] = filp_open(sh->names[k], O_WRONLY | O_CREAT | O_EXCL, 0);
+		if (!IS_ERR(sh->filp[k]))
+			sh->created[k] = 1;
+		else if (PTR_ERR(sh->filp[k]) == -EEXIST)
+			sh->filp[k] = filp_open(sh->names[k], O_WRONLY, 0);
+		if (IS_ERR(sh->temp[k]) || IS_ERR(sh->filp[k])) {
+			printk(KERN_ERR "open shard %u ERROR\n", k);
+			if (IS_ERR(sh->temp[k]))
+				sh->temp[k] = NULL;
+			if (IS_ERR(sh->filp[k]))
+				sh->filp[k] = NULL;
+			return -EACCES;
+		}
+		if (sh->filp[k]->f_inode == file_in1->f_inode
+		    || sh->filp[k]->f_inode == file_in2->f_inode) {
+			printk(KERN_ERR "shard %u and an input file are same\n", k);
+			return -EINVAL;
+		}
+
+		/*setting permissions same as input file*/
+		sh->temp[k]->f_path.dentry->d_inode->i_mode =
+		    file_in1->f_path.dentry->d_inode->i_mode;
+		sh->filp[k]->f_path.dentry->d_inode->i_mode =
+		    file_in1->f_path.dentry->d_inode->i_mode;
+	}
+	return 0;
+}
+
+/*
+ * shard_finish : flush every shard, rename it in place and report the
+ * lines of each. Shards are published one by one, if one fails the ones
+ * before it stay in place
+ * @sh : shards
+ * @finput : arguments of the merge
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+shard_finish(shardset *sh, fileinput *finput) {
+	unsigned int counts[XMERGE_MAX_SHARDS];
+	struct file *tmp;
+	struct file *out;
+	unsigned int k;
+	int err;
+
+	for (k = 0; k < sh->n; k++) {
+		tmp = sh->temp[k];
+		out = sh->filp[k];
+		err = flush_out_buffer(tmp, &sh->outbuf[k], 1);
+		if (err < 0)
+			return err;
+		if ((finput->flags & F_SYNC) != 0) {
+			err = vfs_fsync(tmp, 1);
+			if (err < 0)
+				return err;
+		}
+
+		/*the output opened in shard_setup is replaced*/
+		lock_rename(out->f_path.dentry->d_parent, tmp->f_path.dentry->d_parent);
+		err = vfs_rename(tmp->f_path.dentry->d_parent->d_inode, tmp->f_path.dentry,
+				 out->f_path.dentry->d_parent->d_inode, out->f_path.dentry,
+				 NULL, 0);
+		unlock_rename(out->f_path.dentry->d_parent, tmp->f_path.dentry->d_parent);
+		if (err < 0) {
+			printk(KERN_ERR "rename of shard %u failed\n", k);
+			return err;
+		}
+		sh->published[k] = 1;
+
+		counts[k] = sh->outbuf[k].lines;
+	}
+	if (finput->shardcounts
+	    && copy_to_user(finput->shardcounts, counts,
+			    sh->n * sizeof(unsigned int)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ *
+ * file_line_write : Method to write a line into the file
+ * @filp : file pointer to the file in which we want to write
+ * @buf : points to the line buffer which needs to be written to the file
+ * @len : length of the data that needs to be written
+ * @lastout : points to the last line written to output
+ *
+ * this method use vfs_write to write to the file, every stride-th line
+ * is also recorded in the sparse index if one is written.
+ * The line written becomes the last line by swapping the @buf and
+ * @lastout buffers instead of copying it, so @buf holds a stale line
+ * afterwards and has to be read again before it is used. When merging
+ * into a user buffer, or with a line limit, -ENOSPC is returned with
+ * outbuf->stop set once the line does not fit or is over the limit.
+ * A sharded output passes the line on to the buffer of its shard. A
+ * front coded output stores only what the line does not share with
+ * @lastout, except on restart points
+ *
+ * Returns number of bytes written to the file, -ve in case of error
+ *
+ */
+
+static int
+file_line_write(struct file *filp, char **buf, int len, outputbuf *outbuf, char **lastout) {
+	char *line = *buf;
+	unsigned char hdr[10];
+	int hlen = 0;
+	int shared = 0;
+	int need = len;
+	unsigned int k;
+	int err = 0;
+
+	/* the line would not fit in the user buffer, the merge stops here */
+	if (outbuf->ubuf
+	    && outbuf->ufilled + outbuf->currsize + len > outbuf->ulen) {
+		outbuf->full = 1;
+		outbuf->stop = 1;
+		return -ENOSPC;
+	}
+	/* the line limit is reached, the merge stops here */
+	if (outbuf->limit && outbuf->lines >= outbuf->limit) {
+		outbuf->stop = 1;
+		return -ENOSPC;
+	}
+	if (outbuf->shard) {
+		k = shard_pick(outbuf->shard, line, len);
+		err = file_line_write(outbuf->shard->temp[k], buf, len,
+				      &outbuf->shard->outbuf[k], lastout);
+		if (err >= 0)
+			outbuf->lines++;
+		return err;
+	}
+	if (outbuf->restart) {
+		if ((outbuf->lines % outbuf->restart) != 0)
+			while (shared < len - 1 && (*lastout)[shared] == line[shared])
+				shared++;
+		hlen = fc_put(hdr, shared);
+		hlen += fc_put(hdr + hlen, len - shared);
+		need = hlen + len - shared;
+	}
+	if (outbuf->availsize < need) {
+		err = flush_out_buffer(filp, outbuf, 0);
+		if (err < 0)
+			goto WRITE_OUT;
+		if (outbuf->ckpt) {
+			err = ckpt_write(outbuf->ckpt, filp, outbuf, *lastout);
+			if (err < 0)
+				goto WRITE_OUT;
+		}
+		err = progress_update(outbuf, filp, 0);
+		if (err < 0)
+			goto WRITE_OUT;
+		outbuf->currsize = 0;
+		outbuf->availsize = MAX_OUTBUF_SIZE;
+	}
+	if (outbuf->idx && (outbuf->lines % outbuf->idx->stride) == 0) {
+		err = index_add(outbuf->idx, line, filp->f_pos + outbuf->currsize);
+		if (err < 0)
+			goto WRITE_OUT;
+	}
+	memcpy(outbuf->buffer + outbuf->currsize, hdr, hlen);
+	memcpy(outbuf->buffer + outbuf->currsize + hlen, line + shared, len - shared);
+	outbuf->currsize += need;
+	err = len;
+	*buf = *lastout;
+	*lastout = line;
+	outbuf->availsize = outbuf->availsize - need;
+	outbuf->lines++;
+WRITE_OUT:
+return err;
+}
+
+/*
+ * fill_in_buffer : Method used to fill the buffer with file data
+ * @filp : file pointer which we need to read
+ * @inbuf : buffer which needs to be filled by file data
+ *
+ * this methon uses vfs_read to read the file, an encrypted file is
+ * decrypted right after the read, before it is inflated
+ * returns number of bytes it read, -ve in case of error
+ */
+
+static int
+fill_in_buffer(struct file *filp, inputbuf *inbuf) {
+	int err = 0;
+	int zret;
+	mm_segment_t oldfs;
+	struct z_stream_s *zstrm = inbuf->zstrm;
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	if (zstrm == NULL) {
+		err = cipher_read(filp, inbuf->cs, inbuf->buffer + inbuf->size,
+		MAX_INBUF_SIZE - inbuf->size);
+		goto OUT_FILL;
+	}
+
+	/* compressed input, inflate straight into the chunk buffer */
+	if (inbuf->zend)
+		goto OUT_FILL;
+	zstrm->next_out = (unsigned char *) inbuf->buffer + inbuf->size;
+	zstrm->avail_out = MAX_INBUF_SIZE - inbuf->size;
+	while (zstrm->avail_out == MAX_INBUF_SIZE - inbuf->size) {
+		if (zstrm->avail_in == 0) {
+			err = cipher_read(filp, inbuf->cs, inbuf->zbuf, MAX_INBUF_SIZE);
+			if (err <= 0)
+				goto OUT_FILL;
+			zstrm->next_in = (unsigned char *) inbuf->zbuf;
+			zstrm->avail_in = err;
+		}
+		zret = zlib_inflate(zstrm, Z_SYNC_FLUSH);
+		if (zret == Z_STREAM_END) {
+			inbuf->zend = 1;
+			break;
+		}
+		if (zret != Z_OK && zret != Z_BUF_ERROR) {
+			printk(KERN_ERR "corrupted compressed input\n");
+			err = -EIO;
+			goto OUT_FILL;
+		}
+	}
+	err = (MAX_INBUF_SIZE - inbuf->size) - zstrm->avail_out;
+OUT_FILL:
+	set_fs(oldfs);
+return err;
+}
+
+/*
+ * fc_fetch : take bytes of a front coded input from its chunk buffer
+ * @filp : input file
+ * @inbuf : input buffer of the file
+ * @dst : filled with the bytes
+ * @n : number of bytes wanted
+ *
+ * returns number of bytes taken, less than @n at end of file, -ve in
+ * case of error
+ */
+static int
+fc_fetch(struct file *filp, inputbuf *inbuf, char *dst, unsigned int n) {
+	unsigned int got = 0;
+	unsigned int c;
+	int err;
+
+	while (got < n) {
+		if (inbuf->size == 0) {
+			inbuf->start = 0;
+			err = fill_in_buffer(filp, inbuf);
+			if (err <= 0)
+				return (err < 0) ? err : got;
+			inbuf->size = err;
+		}
+		c = min(n - got, inbuf->size);
+		memcpy(dst + got, inbuf->buffer + inbuf->start, c);
+		inbuf->start += c;
+		inbuf->size -= c;
+		got += c;
+	}
+	return got;
+}
+
+/*
+ * fc_get : read a varint of a front coded input
+ * @filp : input file
+ * @inbuf : input buffer of the file
+ * @v : filled with the value
+ *
+ * returns 1 on success, 0 at end of file, -ve in case of error
+ */
+static int
+fc_get(struct file *filp, inputbuf *inbuf, unsigned int *v) {
+	unsigned char b;
+	int shift = 0;
+	int err;
+
+	*v = 0;
+	do {
+		err = fc_fetch(filp, inbuf, (char *) &b, 1);
+		if (err <= 0)
+			return (err < 0 || shift == 0) ? err : -EIO;
+		if (shift > 28)
+			return -EIO;
+		/*the fifth byte only has 4 bits left of 32*/
+		if (shift == 28 && (b & 0x70))
+			return -EINVAL;
+		*v |= (unsigned int) (b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	return 1;
+}
+
+/*
+ * fc_line_read : decode the next line of a front coded input
+ * @filp : input file
+ * @buf : filled with the line, newline included
+ * @inbuf : input buffer of the file
+ *
+ * the line is rebuilt in @linebuf on top of the previous one, which
+ * still holds the shared prefix
+ *
+ * returns length of the line, 0 at end of file, -ve in case of error
+ */
+static int
+fc_line_read(struct file *filp, char *buf, inputbuf *inbuf) {
+	unsigned int shared;
+	unsigned int rest;
+	int err;
+
+	err = fc_get(filp, inbuf, &shared);
+	if (err <= 0)
+		return err;
+	err = fc_get(filp, inbuf, &rest);
+	if (err <= 0)
+		goto OUT_FC;
+	if (shared > inbuf->fclen || rest == 0 || shared + rest >= PAGE_SIZE) {
+		err = -EIO;
+		goto OUT_FC;
+	}
+	err = fc_fetch(filp, inbuf, inbuf->linebuf + shared, rest);
+	if (err >= 0 && (err != rest || inbuf->linebuf[shared + rest - 1] != '\n'))
+		err = -EIO;
+	if (err < 0)
+		goto OUT_FC;
+	inbuf->fclen = shared + rest;
+	inbuf->linebuf[inbuf->fclen] = '\0';
+	memcpy(buf, inbuf->linebuf, inbuf->fclen + 1);
+	return inbuf->fclen;
+
+OUT_FC:
+	printk(KERN_ERR "corrupted front coded input\n");
+	return (err < 0) ? err : -EIO;
+}
+
+/*
+ * fc_detect : check if an input is front coded
+ * @filp : input file, at the start of its data
+ * @inbuf : input buffer of the file, after zinput_detect
+ *
+ * the start of the data is read into the chunk buffer to look for the
+ * magic. A compressed input keeps it there for file_line_read, other
+ * inputs are read again from the start, as zinput_detect leaves them
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+fc_detect(struct file *filp, inputbuf *inbuf) {
+	int err;
+
+	inbuf->fc = 0;
+	err = fill_in_buffer(filp, inbuf);
+	if (err < 0)
+		return err;
+	inbuf->start = 0;
+	inbuf->size = err;
+	if (inbuf->size >= XFC_HEADER_LEN
+	    && memcmp(inbuf->buffer, XFC_MAGIC, XFC_MAGIC_LEN) == 0) {
+		if (inbuf->buffer[XFC_MAGIC_LEN] != XFC_VERSION) {
+			printk(KERN_ERR "front coded input of unknown version\n");
+			return -EINVAL;
+		}
+		inbuf->start = XFC_HEADER_LEN;
+		inbuf->size -= XFC_HEADER_LEN;
+		inbuf->fc = 1;
+		inbuf->fclen = 0;
+		return 0;
+	}
+	if (inbuf->zstrm == NULL) {
+		filp->f_pos = inbuf->cs ? SHA_KEY_LENGTH : 0;
+		inbuf->size = 0;
+	}
+	return 0;
+}
+
+/*
+ * page_release : drop the page cache page an input is reading
+ */
+static void
+page_release(inputbuf *inbuf) {
+	if (inbuf == NULL || inbuf->page == NULL)
+		return;
+	kunmap(inbuf->page);
+	put_page(inbuf->page);
+	inbuf->page = NULL;
+	inbuf->kaddr = NULL;
+}
+
+/*
+ * page_get : make the page of the file at @index the current page of
+ * the input, reading it ahead if it is not cached
+ * @filp : input file
+ * @inbuf : input buffer of the file
+ * @index : page index in the file
+ * @last : index of the last page of the file, bounds the readahead
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+page_get(struct file *filp, inputbuf *inbuf, pgoff_t index, pgoff_t last) {
+	struct address_space *mapping = filp->f_mapping;
+	struct page *page;
+
+	if (inbuf->page && inbuf->page->index == index)
+		return 0;
+	page_release(inbuf);
+
+	page = find_get_page(mapping, index);
+	if (page == NULL) {
+		page_cache_sync_readahead(mapping, &filp->f_ra, filp, index,
+					  last - index + 1);
+	} else {
+		if (PageReadahead(page))
+			page_cache_async_readahead(mapping, &filp->f_ra, filp,
+						   page, index, last - index + 1);
+		put_page(page);
+	}
+	page = read_mapping_page(mapping, index, filp);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	inbuf->page = page;
+	inbuf->kaddr = kmap(page);
+	return 0;
+}
+
+/*
+ * page_line_read : read one line of a plain file from its page cache
+ * @filp : input file, f_pos is the offset of the line
+ * @buf : buffer in which the line is written
+ * @inbuf : input buffer of the file
+ *
+ * the line is copied once, from the page to @buf. A line that straddles
+ * pages is stitched together in @buf. Like file_line_read, a last line
+ * without newline gets one
+ *
+ * returns number of bytes of the line, 0 at end of file, -ve in case of error
+ */
+static int
+page_line_read(struct file *filp, char *buf, inputbuf *inbuf) {
+	loff_t isize = i_size_read(file_inode(filp));
+	pgoff_t last = (isize - 1) >> PAGE_SHIFT;
+	unsigned int off;
+	unsigned int avail;
+	unsigned int n;
+	char *nl;
+	int j = 0;
+	int err;
+
+	while (filp->f_pos < isize) {
+		err = page_get(filp, inbuf, filp->f_pos >> PAGE_SHIFT, last);
+		if (err < 0)
+			return err;
+		off = filp->f_pos & ~PAGE_MASK;
+		avail = min_t(loff_t, PAGE_SIZE - off, isize - filp->f_pos);
+		nl = memchr(inbuf->kaddr + off, '\n', avail);
+		n = nl ? (nl - (inbuf->kaddr + off)) + 1 : avail;
+		if (j + n + 2 > PAGE_SIZE) {
+			printk(KERN_ERR "line longer than a page\n");
+			return -EINVAL;
+		}
+		memcpy(buf + j, inbuf->kaddr + off, n);
+		j += n;
+		filp->f_pos += n;
+		if (nl) {
+			buf[j] = '\0';
+			return j;
+		}
+	}
+	if (j == 0)
+		return 0;
+	buf[j++] = '\n';
+	buf[j] = '\0';
+	return j;
+}
+
+/*
+ * this function is used to compare 2 strings
+ * @input1 : input line 1
+ * @input2 : input line 2
+ * @CASE_INSE : this is flag to indicate of comparison needs to be done
+ * case insensitive, if value passes is 1 than comparison will be done case
+ * insensitive, other wise case sensitive
+ * returns a 0 if both strings are same
+ * 1 if input1 is greater than input2
+ * -1 if input1 is less then input2
+ */
+static int
+strcmputil(char *input1, char *input2, int CASE_INSE) {
+	if (CASE_INSE == 1)
+		return strcasecmp(input1, input2);
+	else
+		return strcmp(input1, input2);
+}
+
+/*
+ * file_line_read : method to read one line from the file/buffer
+ * @filp : file pointer which we need to read
+ * @buf : buffer in which we will be writing out line
+ * @inbuf : temporary structure buffer which is used to cache the data
+ *
+ * this function tries to read from inbuf if it has some data, else it fills it inbuf again and read next line from it
+ * once the end of file, or the upper key of a key range, is reached it keeps returning 0
+ * plain inputs skip the chunk buffer and are read by page_line_read
+ *
+ * returns number of bytes it read, -ve in case or error
+ *
+ */
+static int
+file_line_read(struct file *filp, char *buf, inputbuf *inbuf) {
+	int i = 0;
+	int err = 0;
+	int j = 0;
+	char *data = NULL;
+
+	if (inbuf->eof)
+		return 0;
+	if (inbuf->pgread) {
+		err = page_line_read(filp, buf, inbuf);
+		goto OUT_READ;
+	}
+	if (inbuf->fc) {
+		err = fc_line_read(filp, buf, inbuf);
+		goto OUT_READ;
+	}
+	if (inbuf->size == 0) {
+		err = fill_in_buffer(filp, inbuf);
+		if (err <= 0)
+			goto OUT_READ;
+		inbuf->start = 0;
+		inbuf->size = inbuf->size + err;
+	}
+	if (inbuf->size > 0) {
+		data = inbuf->linebuf;
+READ_START:
+		j = 0;
+		i = inbuf->start;
+		while (i < (inbuf->start + inbuf->size)) {
+			if (inbuf->buffer[i] == '\n') {
+				data[j++] = '\n';
+				data[j++] = '\0';
+				inbuf->start = (i + 1 == MAX_INBUF_SIZE) ? -1 : i + 1;
+				inbuf->size = inbuf->size - j + 1;
+				strcpy(buf, data);
+				err = j - 1;
+				goto OUT_READ;
+			}
+			data[j++] = inbuf->buffer[i];
+			i++;
+		}
+	}
+
+	memcpy(inbuf->buffer, data, j);
+	inbuf->size = j;
+	inbuf->start = 0;
+	err = fill_in_buffer(filp, inbuf);
+	if (err < 0) {
+		goto OUT_READ;
+	} else if (err == 0) {
+		inbuf->buffer[j] = '\n';
+		inbuf->size = inbuf->size + 1;
+	} else {
+		inbuf->size = inbuf->size + err;
+	}
+	goto READ_START;
+
+OUT_READ:
+	/* with an upper key, the first line at or above it ends the input */
+	if (err > 0 && inbuf->hikey) {
+		if (strcmputil(buf, inbuf->hikey, inbuf->insen) >= 0)
+			err = 0;
+	}
+	if (err > 0)
+		inbuf->consumed += err;
+	else if (err == 0)
+		inbuf->eof = 1;
+	return err;
+}
+
+/*
+ * gallop_first : check if a line of a run sorts before the head of the
+ * other input, and before the upper key of a key range
+ * @line : line, not NUL terminated, ending with its newline
+ * @len : length of @line
+ * @other : current line of the other input
+ * @hikey : upper key of the input, or NULL
+ * @insen : compare case insensitive
+ *
+ * lines have one newline at their end, so comparing @len bytes orders them
+ * as strcmputil does. Lines equal to @other end the run, ties are left to
+ * the merge loop
+ */
+static int
+gallop_first(char *line, unsigned int len, char *other, char *hikey, int insen) {
+	if ((insen ? strncasecmp(line, other, len) : strncmp(line, other, len)) >= 0)
+		return 0;
+	if (hikey && (insen ? strncasecmp(line, hikey, len)
+		      : strncmp(line, hikey, len)) >= 0)
+		return 0;
+	return 1;
+}
+
+/*
+ * gallop_span : find how many bytes of whole lines at the start of @base
+ * sort before the head of the other input
+ * @base, @len : buffered lines of the input, @len ends on a newline
+ * @other, @hikey, @insen : as for gallop_first
+ *
+ * the lines are probed 1, 2, 4 ... bytes further each time until one does
+ * not sort first, then the crossover is binary searched between the last
+ * two probes. A byte offset is taken to the start of the line it falls in
+ *
+ * returns length of the run in bytes, always on a line boundary
+ */
+static unsigned int
+gallop_span(char *base, unsigned int len, char *other, char *hikey, int insen) {
+	unsigned int lo = 0;
+	unsigned int hi = len;
+	unsigned int step = 1;
+	unsigned int off;
+	unsigned int s;
+	unsigned int e;
+
+	while (lo < len) {
+		off = min(lo + step - 1, len - 1);
+		for (s = off; s > lo && base[s - 1] != '\n'; s--)
+			;
+		e = (char *) memchr(base + s, '\n', len - s) - base + 1;
+		if (!gallop_first(base + s, e - s, other, hikey, insen)) {
+			hi = s;
+			break;
+		}
+		lo = e;
+		step <<= 1;
+	}
+	while (lo < hi) {
+		off = lo + (hi - lo) / 2;
+		for (s = off; s > lo && base[s - 1] != '\n'; s--)
+			;
+		e = (char *) memchr(base + s, '\n', hi - s) - base + 1;
+		if (gallop_first(base + s, e - s, other, hikey, insen))
+			lo = e;
+		else
+			hi = s;
+	}
+	return lo;
+}
+
+/*
+ * gallop_run : copy the run of lines of one input that sort before the
+ * head of the other input to the output as one block
+ * @filp_in : input file
+ * @inbuf : input buffer of the file, its current line was just written
+ * @other : current line of the other input
+ * @insen : compare case insensitive
+ * @filp : temp file in which output is written
+ * @outbuf : output buffer
+ * @lastout : points to the last line written to output
+ *
+ * only the lines already buffered are looked at, the chunk buffer or the
+ * rest of the current page cache page. The input is moved past the run,
+ * so its next file_line_read returns the line after it
+ *
+ * returns number of lines written, -ve in case of error
+ */
+static int
+gallop_run(struct file *filp_in, inputbuf *inbuf, char *other, int insen,
+	   struct file *filp, outputbuf *outbuf, char **lastout) {
+	char *base;
+	unsigned int len;
+	unsigned int off;
+	unsigned int n;
+	unsigned int last;
+	char *p;
+	int lines = 0;
+	int err;
+
+	/* a front coded input holds encoded lines, not copyable as they are */
+	if (inbuf->fc)
+		return 0;
+	if (inbuf->pgread) {
+		off = filp_in->f_pos & ~PAGE_MASK;
+		if (inbuf->page == NULL || (off == 0 && inbuf->page->index
+					    != filp_in->f_pos >> PAGE_SHIFT))
+			return 0;
+		base = inbuf->kaddr + off;
+		len = min_t(loff_t, PAGE_SIZE - off,
+			    i_size_read(file_inode(filp_in)) - filp_in->f_pos);
+	} else {
+		if (inbuf->start < 0 || inbuf->size == 0)
+			return 0;
+		base = inbuf->buffer + inbuf->start;
+		len = inbuf->size;
+	}
+	/* a partial line at the end is left to file_line_read */
+	while (len > 0 && base[len - 1] != '\n')
+		len--;
+	if (len == 0)
+		return 0;
+
+	len = gallop_span(base, len, other, inbuf->hikey, insen);
+	if (len == 0)
+		return 0;
+	for (last = len - 1; last > 0 && base[last - 1] != '\n'; last--)
+		;
+	if (len - last >= PAGE_SIZE)
+		return -EINVAL;
+
+	/* block copy, flushing as often as the output buffer fills */
+	for (off = 0; off < len; off += n) {
+		if (outbuf->availsize == 0) {
+			err = flush_out_buffer(filp, outbuf, 0);
+			if (err < 0)
+				return err;
+			err = progress_update(outbuf, filp, 0);
+			if (err < 0)
+				return err;
+			outbuf->currsize = 0;
+			outbuf->availsize = MAX_OUTBUF_SIZE;
+		}
+		n = min(len - off, outbuf->availsize);
+		memcpy(outbuf->buffer + outbuf->currsize, base + off, n);
+		outbuf->currsize += n;
+		outbuf->availsize -= n;
+	}
+	for (p = base; p < base + len; p = (char *) memchr(p, '\n', base + len - p) + 1)
+		lines++;
+	memcpy(*lastout, base + last, len - last);
+	(*lastout)[len - last] = '\0';
+
+	if (inbuf->pgread) {
+		filp_in->f_pos += len;
+	} else {
+		inbuf->start += len;
+		inbuf->size -= len;
+	}
+	inbuf->consumed += len;
+	outbuf->lines += lines;
+	return lines;
+}
+
+/*
+ * setop_emit : write one line of a set operation to the output buffer
+ * @filp : temp file in which output is written
+ * @line : points to the line selected by the set operation
+ * @outbuf : output buffer
+ * @lastout : points to the last line written to output
+ * @flags : flags given by the user
+ *
+ * lines equal to lastout are dropped with -u, lines smaller than lastout
+ * are dropped, or reported with -t
+ *
+ * returns 1 if line was written, 0 if skipped, -ve in case of error
+ */
+static int
+setop_emit(struct file *filp, char **line, outputbuf *outbuf, char **lastout,
+	   unsigned int flags) {
+	int insen = ((flags & F_CASE_INSEN) != 0) ? 1 : 0;
+	int cmp;
+	int err;
+
+	if (strlen(*lastout) > 0) {
+		cmp = strcmputil(*line, *lastout, insen);
+		if (cmp < 0) {
+			if ((flags & F_CHECK_SORTED) != 0) {
+				printk(KERN_ERR "input files are not sorted\n");
+				return -EINVAL;
+			}
+			return 0;
+		}
+		if (cmp == 0 && (flags & F_OUTPUT_UNIQ) != 0)
+			return 0;
+	}
+	err = file_line_write(filp, line, strlen(*line), outbuf, lastout);
+	if (err < 0)
+		return outbuf->stop ? err : -EFAULT;
+	return 1;
+}
+
+/*
+ * setop_merge : walk both sorted inputs in lockstep and write the lines
+ * selected by the set operation flags
+ * @file_in1, @file_in2 : input files
+ * @filp : temp file in which output is written
+ * @inbuf1, @inbuf2 : points to the current line of each input, already loaded
+ * @inputbuf1, @inputbuf2 : chunk buffers of each input
+ * @outbuf : output buffer
+ * @lastout : points to the last line written to output
+ * @flags : flags given by the user
+ * @eof1, @eof2 : set if the input was empty before the first read
+ *
+ * equal lines are paired one to one, so a line repeated n times in
+ * file 1 and m times in file 2 is common min(n, m) times
+ *
+ * returns number of lines written, -ve in case of error
+ */
+static int
+setop_merge(struct file *file_in1, struct file *file_in2, struct file *filp,
+	    char **inbuf1, char **inbuf2, inputbuf *inputbuf1,
+	    inputbuf *inputbuf2, outputbuf *outbuf, char **lastout,
+	    unsigned int flags, int eof1, int eof2) {
+	int insen = ((flags & F_CASE_INSEN) != 0) ? 1 : 0;
+	int only1 = ((flags & (F_SET_ONLY1 | F_SET_SYMDIFF)) != 0);
+	int only2 = ((flags & (F_SET_ONLY2 | F_SET_SYMDIFF)) != 0);
+	int common = ((flags & F_SET_COMMON) != 0);
+	int count = 0;
+	int cmp;
+	int err = 0;
+
+	while (!eof1 && !eof2) {
+		cmp = strcmputil(*inbuf1, *inbuf2, insen);
+		if ((cmp < 0 && only1) || (cmp == 0 && common))
+			err = setop_emit(filp, inbuf1, outbuf, lastout, flags);
+		else if (cmp > 0 && only2)
+			err = setop_emit(filp, inbuf2, outbuf, lastout, flags);
+		if (err < 0)
+			return err;
+		count += err;
+
+		if (cmp <= 0) {
+			err = file_line_read(file_in1, *inbuf1, inputbuf1);
+			if (err < 0)
+				return -EFAULT;
+			eof1 = (err == 0);
+		}
+		if (cmp >= 0) {
+			err = file_line_read(file_in2, *inbuf2, inputbuf2);
+			if (err < 0)
+				return -EFAULT;
+			eof2 = (err == 0);
+		}
+		err = 0;
+	}
+
+	/* whatever is left in one input has no partner in the other */
+	while (!eof1) {
+		if (only1) {
+			err = setop_emit(filp, inbuf1, outbuf, lastout, flags);
+			if (err < 0)
+				return err;
+			count += err;
+		}
+		err = file_line_read(file_in1, *inbuf1, inputbuf1);
+		if (err < 0)
+			return -EFAULT;
+		eof1 = (err == 0);
+	}
+	while (!eof2) {
+		if (only2) {
+			err = setop_emit(filp, inbuf2, outbuf, lastout, flags);
+			if (err < 0)
+				return err;
+			count += err;
+		}
+		err = file_line_read(file_in2, *inbuf2, inputbuf2);
+		if (err < 0)
+			return -EFAULT;
+		eof2 = (err == 0);
+	}
+	return count;
+}
+
+/*
+ * Structure describing one byte range checked by a verify worker.
+ * A range owns every line starting inside [@start, @end)
+ * @filp : file being verified
+ * @start, @end : byte range of the file
+ * @insen : compare case insensitive
+ * @lines : number of lines owned by the range
+ * @firstpos : offset of the first line of the range, -1 if it has none
+ * @badpos : offset of the first line out of order, -1 if none
+ * @badline : line number of that line inside the range, 1 based
+ * @first : first line of the range
+ * @last : last line of the range, when no line is out of order
+ * @err : error of the worker, 0 on success
+ * @done : completed when the worker is finished
+ */
+typedef struct verifyrange {
+	struct file *filp;
+	loff_t start;
+	loff_t end;
+	int insen;
+	unsigned long long lines;
+	loff_t firstpos;
+	loff_t badpos;
+	unsigned long long badline;
+	char *first;
+	char *last;
+	int err;
+	struct completion done;
+} verifyrange;
+
+/*
+ * verify_line : account one line of a range, compare it to previous one
+ * @vr : range being verified
+ * @prev : previous line of the range
+ * @cur : current line
+ * @pos : offset of current line
+ *
+ * returns 1 if the line is out of order, 0 otherwise
+ */
+static int
+verify_line(verifyrange *vr, char *prev, char *cur, loff_t pos) {
+	vr->lines++;
+	if (vr->lines == 1) {
+		strcpy(vr->first, cur);
+		vr->firstpos = pos;
+		return 0;
+	}
+	if (strcmputil(prev, cur, vr->insen) > 0) {
+		vr->badpos = pos;
+		vr->badline = vr->lines;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * verify_range : worker checking that the lines of one range are sorted
+ * @data : verifyrange to check
+ *
+ * the worker starts one byte before its range and skips to the first
+ * line boundary, the line straddling the start belongs to the previous
+ * range. Lines keep their newline so they compare like file_line_read
+ * returns them. Lines longer than a page are compared on their prefix.
+ */
+static int
+verify_range(void *data) {
+	verifyrange *vr = (verifyrange *) data;
+	mm_segment_t oldfs;
+	char *buf = NULL;
+	char *line[2] = { NULL, NULL };
+	char *tmp;
+	loff_t pos = (vr->start > 0) ? vr->start - 1 : 0;
+	loff_t off = pos;
+	loff_t curstart = -1;
+	int skipping = (vr->start > 0);
+	int len = 0;
+	int n;
+	int k;
+
+	buf = kmalloc(VERIFY_BUF_SIZE, GFP_KERNEL);
+	line[0] = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	line[1] = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!buf || !line[0] || !line[1]) {
+		vr->err = -ENOMEM;
+		goto OUT_RANGE;
+	}
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	for (;;) {
+		n = vfs_read(vr->filp, buf, VERIFY_BUF_SIZE, &pos);
+		if (n < 0) {
+			vr->err = n;
+			break;
+		}
+		if (n == 0) {
+			/* last line of the file without a newline */
+			if (curstart >= 0) {
+				line[1][len++] = '\n';
+				line[1][len] = '\0';
+				verify_line(vr, line[0], line[1], curstart);
+				tmp = line[0];
+				line[0] = line[1];
+				line[1] = tmp;
+			}
+			break;
+		}
+		for (k = 0; k < n; k++, off++) {
+			if (skipping) {
+				if (buf[k] == '\n')
+					skipping = 0;
+				continue;
+			}
+			if (curstart < 0) {
+				if (off >= vr->end)
+					goto OUT_READ;
+				curstart = off;
+				len = 0;
+			}
+			if (len < PAGE_SIZE - 2)
+				line[1][len++] = buf[k];
+			if (buf[k] != '\n')
+				continue;
+			line[1][len] = '\0';
+			if (verify_line(vr, line[0], line[1], curstart))
+				goto OUT_READ;
+			tmp = line[0];
+			line[0] = line[1];
+			line[1] = tmp;
+			curstart = -1;
+		}
+	}
+OUT_READ:
+	set_fs(oldfs);
+	if (vr->lines > 0 && vr->badpos < 0)
+		strcpy(vr->last, line[0]);
+
+OUT_RANGE:
+	kfree(buf);
+	kfree(line[0]);
+	kfree(line[1]);
+	complete(&vr->done);
+	return 0;
+}
 
 /*
+ * verify_sorted : check if infile1 is sorted without writing any output
+ * @finput : argument structure passed by user
  *
- * file_line_write : Method to write a line into the file
- * @filp : file pointer to the file in which we want to write
- * @buf : buffer pointer which needs to be written to the file
- * @len : length of the data that needs to be written
- *
- * this method use vfs_write to write to the file
- *
- * Returns number of bytes written to the file, -ve in case of error
+ * the file is cut in byte ranges, each range is checked by its own
+ * kernel thread, then the pairs of lines around the range boundaries
+ * are compared. The first line out of order is reported in
+ * finput->check, with an offset of -1 if the file is sorted
  *
+ * returns 0 on success, -ve in case of error
  */
-
 static int
-file_line_write(struct file *filp, char *buf, int len, outputbuf *outbuf, char *lastout) {
-	mm_segment_t oldfs;
+verify_sorted(fileinput *finput) {
+	struct file *filp = NULL;
+	verifyrange *vr = NULL;
+	struct task_struct *task;
+	sortcheck result;
+	unsigned long long before = 0;
+	loff_t size;
+	loff_t chunk;
+	char *prevlast = NULL;
+	int insen = ((finput->flags & F_CASE_INSEN) != 0) ? 1 : 0;
+	int nr;
+	int k;
 	int err = 0;
-	int i;
 
-	if (outbuf->availsize < len) {
-		oldfs = get_fs();
-		set_fs(KERNEL_DS);
-		err = vfs_write(filp, outbuf->buffer, outbuf->currsize, &filp->f_pos);
-		if (err < 0)
-			goto WRITE_OUT;
-		set_fs(oldfs);
-		outbuf->currsize = 0;
-		outbuf->availsize = MAX_OUTBUF_SIZE;
-		memset(outbuf->buffer, 0, MAX_OUTBUF_SIZE);
+	filp = filp_open(finput->infile1, O_RDONLY, 0);
+	if (!filp || IS_ERR(filp)) {
+		printk(KERN_ERR "open FILE ERROR\n");
+		filp = NULL;
+		err = -EACCES;
+		goto OUT_VERIFY;
 	}
-	for (i = 0; i < len; i++)
-		outbuf->buffer[(outbuf->currsize)++] = buf[i];
-	err = i + 1;
-	strcpy(lastout, buf);
-	outbuf->availsize = outbuf->availsize - len;
-WRITE_OUT:
-return err;
+	size = i_size_read(file_inode(filp));
+
+	nr = (verify_workers > 0) ? verify_workers : num_online_cpus();
+	if (nr > VERIFY_MAX_RANGES)
+		nr = VERIFY_MAX_RANGES;
+	if (nr > div64_s64(size + VERIFY_MIN_RANGE - 1, VERIFY_MIN_RANGE))
+		nr = div64_s64(size + VERIFY_MIN_RANGE - 1, VERIFY_MIN_RANGE);
+	if (nr < 1)
+		nr = 1;
+	chunk = div64_s64(size + nr - 1, nr);
+
+	vr = (verifyrange *) kcalloc(nr, sizeof(verifyrange), GFP_KERNEL);
+	if (vr == NULL) {
+		err = -ENOMEM;
+		goto OUT_VERIFY;
+	}
+	for (k = 0; k < nr; k++) {
+		vr[k].filp = filp;
+		vr[k].start = k * chunk;
+		vr[k].end = (k == nr - 1) ? size : (k + 1) * chunk;
+		vr[k].insen = insen;
+		vr[k].firstpos = -1;
+		vr[k].badpos = -1;
+		init_completion(&vr[k].done);
+		vr[k].first = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		vr[k].last = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!vr[k].first || !vr[k].last) {
+			err = -ENOMEM;
+			goto OUT_VERIFY;
+		}
+	}
+
+	/* one thread per range, a range is checked inline if none can be made */
+	for (k = 0; k < nr; k++) {
+		task = kthread_run(verify_range, &vr[k], "xverify/%d", k);
+		if (IS_ERR(task))
+			verify_range(&vr[k]);
+	}
+	for (k = 0; k < nr; k++)
+		wait_for_completion(&vr[k].done);
+
+	/* walk the ranges in file order, the first problem found is the first in the file */
+	result.offset = -1;
+	result.line = 0;
+	for (k = 0; k < nr; k++) {
+		if (vr[k].err < 0) {
+			err = vr[k].err;
+			goto OUT_VERIFY;
+		}
+		if (vr[k].lines == 0)
+			continue;
+		if (prevlast && strcmputil(prevlast, vr[k].first, insen) > 0) {
+			result.offset = vr[k].firstpos;
+			result.line = before + 1;
+			break;
+		}
+		if (vr[k].badpos >= 0) {
+			result.offset = vr[k].badpos;
+			result.line = before + vr[k].badline;
+			break;
+		}
+		before += vr[k].lines;
+		prevlast = vr[k].last;
+	}
+
+	if (copy_to_user(finput->check, &result, sizeof(sortcheck)) != 0)
+		err = -EFAULT;
+
+OUT_VERIFY:
+	if (vr) {
+		for (k = 0; k < nr; k++) {
+			kfree(vr[k].first);
+			kfree(vr[k].last);
+		}
+		kfree(vr);
+	}
+	if (filp)
+		filp_close(filp, NULL);
+	return err;
 }
 
 /*
- * fill_in_buffer : Method used to fill the buffer with file data
- * @filp : file pointer which we need to read
- * @inbuf : buffer which needs to be filled by file data
+ * range_line_at : read the line starting at an offset
+ * @filp : file to read
+ * @off : offset of the line
+ * @line : filled with the line, newline included like file_line_read
  *
- * this methon uses vfs_read to read the file
- * returns number of bytes it read, -ve in case of error
+ * returns length of the line, 0 at end of file, -ve in case of error
  */
-
 static int
-fill_in_buffer(struct file *filp, inputbuf *inbuf) {
-	int err = 0;
+range_line_at(struct file *filp, loff_t off, char *line) {
 	mm_segment_t oldfs;
+	char *nl;
+	int n;
 
 	oldfs = get_fs();
 	set_fs(KERNEL_DS);
-	err = vfs_read(filp, inbuf->buffer + inbuf->size,
-	MAX_INBUF_SIZE - inbuf->size, &filp->f_pos);
-	if (err < 0)
-		goto OUT_FILL;
+	n = vfs_read(filp, line, PAGE_SIZE - 2, &off);
 	set_fs(oldfs);
-OUT_FILL:
-return err;
+	if (n <= 0)
+		return n;
+	nl = memchr(line, '\n', n);
+	if (nl != NULL) {
+		n = nl - line + 1;
+	} else {
+		/* last line without newline, or a line longer than a page */
+		line[n++] = '\n';
+	}
+	line[n] = '\0';
+	return n;
 }
 
 /*
- * file_line_read : method to read one line from the file/buffer
- * @filp : file pointer which we need to read
- * @buf : buffer in which we will be writing out line
- * @inbuf : temporary structure buffer which is used to cache the data
+ * range_next_start : find the first line starting at or after an offset
+ * @filp : file to read
+ * @off : offset to start from
+ * @limit : offset where the search stops
+ * @buf : scratch buffer of MAX_INBUF_SIZE bytes
  *
- * this function tries to read from inbuf if it has some data, else it fills it inbuf again and read next line from it
+ * returns offset of the line, @limit if no line starts before it,
+ * -ve in case of error
+ */
+static loff_t
+range_next_start(struct file *filp, loff_t off, loff_t limit, char *buf) {
+	mm_segment_t oldfs;
+	loff_t pos;
+	char *nl;
+	int n;
+
+	if (off == 0)
+		return 0;
+	/* a line starts at off if the byte before it is a newline */
+	pos = off - 1;
+	while (pos < limit) {
+		oldfs = get_fs();
+		set_fs(KERNEL_DS);
+		n = vfs_read(filp, buf, MAX_INBUF_SIZE, &pos);
+		set_fs(oldfs);
+		if (n <= 0)
+			return (n < 0) ? n : limit;
+		nl = memchr(buf, '\n', n);
+		if (nl != NULL) {
+			pos = pos - n + (nl - buf) + 1;
+			return (pos < limit) ? pos : limit;
+		}
+	}
+	return limit;
+}
+
+/*
+ * range_seek : binary search a sorted file for the first line >= key
+ * @filp : file to search
+ * @key : lower key of the range
+ * @insen : compare case insensitive
+ * @buf : scratch buffer of MAX_INBUF_SIZE bytes
+ * @line : scratch buffer of PAGE_SIZE bytes
  *
- * returns number of bytes it read, -ve in case or error
+ * the search keeps lo on a line start with every line before it smaller
+ * than key, and hi on a line start at or above key. Each probe seeks to
+ * the middle and resyncs to the next line start; once no line starts in
+ * the upper half the few lines left are scanned
  *
+ * returns offset of the line, file size if all lines are smaller,
+ * -ve in case of error
  */
-static int
-file_line_read(struct file *filp, char *buf, inputbuf *inbuf) {
-	int i = 0;
-	int err = 0;
-	int j = 0;
-	char *data = NULL;
+static loff_t
+range_seek(struct file *filp, char *key, int insen, char *buf, char *line) {
+	loff_t lo = 0;
+	loff_t hi = i_size_read(file_inode(filp));
+	loff_t p;
+	int len;
 
-	if (inbuf->size == 0) {
-		err = fill_in_buffer(filp, inbuf);
-		if (err <= 0)
-			goto OUT_READ;
-		inbuf->start = 0;
-		inbuf->size = inbuf->size + err;
+	while (lo < hi) {
+		p = range_next_start(filp, lo + (hi - lo) / 2, hi, buf);
+		if (p < 0)
+			return p;
+		if (p >= hi)
+			break;
+		len = range_line_at(filp, p, line);
+		if (len < 0)
+			return len;
+		if (len > 0 && strcmputil(line, key, insen) < 0)
+			lo = p + len;
+		else
+			hi = p;
 	}
-	if (inbuf->size > 0) {
-		data = (char *) kmalloc(PAGE_SIZE, GFP_KERNEL);
-READ_START:
-		j = 0;
-		i = inbuf->start;
-		while (i < (inbuf->start + inbuf->size)) {
-			if (inbuf->buffer[i] == '\n') {
-				data[j++] = '\n';
-				data[j++] = '\0';
-				inbuf->start = (i + 1 == MAX_INBUF_SIZE) ? -1 : i + 1;
-				inbuf->size = inbuf->size - j + 1;
-				strcpy(buf, data);
-				err = j - 1;
-				goto OUT_READ;
-			}
-			data[j++] = inbuf->buffer[i];
-			i++;
-		}
+
+	/* no line starts in the upper half, walk the lines left one by one */
+	while (lo < hi) {
+		len = range_line_at(filp, lo, line);
+		if (len <= 0)
+			return (len < 0) ? len : hi;
+		if (strcmputil(line, key, insen) >= 0)
+			return lo;
+		lo += len;
 	}
+	return hi;
+}
 
-	memcpy(inbuf->buffer, data, j);
-	inbuf->size = j;
-	inbuf->start = 0;
-	err = fill_in_buffer(filp, inbuf);
-	if (err < 0) {
-		goto OUT_READ;
-	} else if (err == 0) {
-		inbuf->buffer[j] = '\n';
-		inbuf->size = inbuf->size + 1;
-	} else {
-		inbuf->size = inbuf->size + err;
+/*
+ * range_setup : position an input at the first line of the key range
+ * @filp : input file
+ * @inbuf : chunk buffer of the input, still unused
+ * @lokey : lower key, or NULL to start at the beginning
+ * @hikey : upper key, or NULL to read until end of file
+ * @insen : compare case insensitive
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+range_setup(struct file *filp, inputbuf *inbuf, char *lokey, char *hikey,
+	    int insen) {
+	loff_t off;
+
+	if (inbuf->zstrm || (inbuf->fc && lokey)) {
+		printk(KERN_ERR "can not seek in compressed input\n");
+		return -EINVAL;
 	}
-	goto READ_START;
+	inbuf->hikey = hikey;
+	inbuf->insen = insen;
+	if (lokey == NULL)
+		return 0;
+	off = range_seek(filp, lokey, insen, inbuf->buffer, inbuf->linebuf);
+	if (off < 0)
+		return off;
+	filp->f_pos = off;
+	inbuf->consumed = off;
+	return 0;
+}
 
-OUT_READ:
-	if (data) {
-		kfree(data);
-		data = NULL;
+/*
+ * incr_setup : position the base of an incremental merge
+ * @base : base file, input 1
+ * @inbuf1 : chunk buffer of the base, still unused
+ * @delta : delta file, input 2
+ * @inbuf2 : chunk buffer of the delta, still unused
+ * @insen : compare case insensitive
+ *
+ * every line of the base below the first line of the delta stays where
+ * it is, so the base is binary searched for the first line at or above
+ * it and is merged from there on. A delta whose first line equals the
+ * last line of the base is not appended, the seek stops on that line so
+ * the last line is merged and rewritten through the temp file
+ *
+ * returns offset of that line, size of the base if the delta goes after
+ * all of it, -ve in case of error
+ */
+static loff_t
+incr_setup(struct file *base, inputbuf *inbuf1, struct file *delta,
+	   inputbuf *inbuf2, int insen) {
+	loff_t off;
+	int len;
+
+	if (inbuf1->zstrm || inbuf2->zstrm || inbuf1->fc || inbuf2->fc) {
+		printk(KERN_ERR "can not merge compressed files in place\n");
+		return -EINVAL;
 	}
-	return err;
+	len = range_line_at(delta, 0, inbuf2->linebuf);
+	if (len < 0)
+		return len;
+	if (len == 0)
+		off = i_size_read(file_inode(base));
+	else
+		off = range_seek(base, inbuf2->linebuf, insen, inbuf1->buffer,
+				 inbuf1->linebuf);
+	if (off < 0)
+		return off;
+	base->f_pos = off;
+	inbuf1->consumed = off;
+	inbuf1->insen = insen;
+	return off;
 }
 
 /*
- * this function is used to compare 2 strings
- * @input1 : input line 1
- * @input2 : input line 2
- * @CASE_INSE : this is flag to indicate of comparison needs to be done
- * case insensitive, if value passes is 1 than comparison will be done case
- * insensitive, other wise case sensitive
- * returns a 0 if both strings are same
- * 1 if input1 is greater than input2
- * -1 if input1 is less then input2
+ * incr_append : get the base ready for the delta to be appended to it
+ * @filp : base file opened for writing
+ * @size : size of the base
+ *
+ * a last line without newline gets one, so the first line of the delta
+ * does not run into it
+ *
+ * returns 0 on success, -ve in case of error
  */
 static int
-strcmputil(char *input1, char *input2, int CASE_INSE) {
-	if (CASE_INSE == 1)
-		return strcasecmp(input1, input2);
-	else
-		return strcmp(input1, input2);
+incr_append(struct file *filp, loff_t size) {
+	mm_segment_t oldfs;
+	loff_t pos = size - 1;
+	char c = '\n';
+	int err = 0;
+
+	filp->f_pos = size;
+	if (size == 0)
+		return 0;
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	err = vfs_read(filp, &c, 1, &pos);
+	if (err == 1 && c != '\n') {
+		c = '\n';
+		err = vfs_write(filp, &c, 1, &filp->f_pos);
+	}
+	set_fs(oldfs);
+	return (err < 0) ? err : 0;
+}
+
+/*
+ * incr_finish : write the merged suffix of an incremental merge over the
+ * base and remove the temp file
+ * @temp : temp file holding the merged suffix
+ * @base : base file opened for writing
+ * @pos : offset in the base the suffix starts at
+ * @buf : scratch buffer of MAX_OUTBUF_SIZE bytes
+ * @sync : fdatasync the base once it is written
+ *
+ * unlike the rename of a full merge this is not atomic. The temp file
+ * is only removed once the base is complete, a failed copy leaves it
+ * behind and later merges of the base refuse to start until it is
+ * dealt with. The base is restored by cutting it before the first line
+ * of the temp file and appending the temp file
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+incr_finish(struct file *temp, struct file *base, loff_t pos, char *buf,
+	    int sync) {
+	mm_segment_t oldfs;
+	loff_t rpos = 0;
+	int n;
+	int err = 0;
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	while ((n = vfs_read(temp, buf, MAX_OUTBUF_SIZE, &rpos)) > 0) {
+		err = vfs_write(base, buf, n, &pos);
+		if (err >= 0 && err != n)
+			err = -EIO;
+		if (err < 0)
+			break;
+	}
+	set_fs(oldfs);
+	if (n < 0)
+		err = n;
+	if (err < 0)
+		return err;
+
+	/*the suffix is shorter when duplicates were dropped*/
+	err = file_truncate(base, pos);
+	if (err == 0 && sync)
+		err = vfs_fsync(base, 1);
+	if (err < 0)
+		return err;
+	return file_unlink(temp);
 }
 
 /*
@@ -226,6 +3055,15 @@ validate(fileinput *usrarg) {
 		err = -EINVAL;
 		goto OUT_VALID;
 	}
+
+	/* verify-only needs the file to check and where to report */
+	if ((usrarg->flags & F_VERIFY_ONLY) != 0) {
+		if (usrarg->infile1 == NULL || usrarg->check == NULL
+		    || vfs_stat(usrarg->infile1, &state) != 0)
+			err = -EINVAL;
+		goto OUT_VALID;
+	}
+
 	/*
 	 *checking for invalid flag combinations
 	 */
@@ -239,9 +3077,152 @@ validate(fileinput *usrarg) {
 		goto OUT_VALID;
 	}
 
+	/* only one set operation can be requested at a time */
+	if ((usrarg->flags & F_SET_MASK) != 0
+	    && ((usrarg->flags & F_SET_MASK) & ((usrarg->flags & F_SET_MASK) - 1)) != 0) {
+		err = -EINVAL;
+		goto OUT_VALID;
+	}
+
+	/* a key range needs at least one bound */
+	if ((usrarg->flags & F_KEY_RANGE) != 0
+	    && usrarg->lokey == NULL && usrarg->hikey == NULL) {
+		err = -EINVAL;
+		goto OUT_VALID;
+	}
+
+	/* the checksum needs somewhere to be returned */
+	if ((usrarg->flags & F_CHECKSUM) != 0 && usrarg->checksum == NULL) {
+		err = -EINVAL;
+		goto OUT_VALID;
+	}
+
+	/*
+	 * galloping copies whole runs, it can only keep all lines and can
+	 * not stop, check or index the output line by line
+	 */
+	if ((usrarg->flags & F_GALLOP) != 0
+	    && ((usrarg->flags & F_OUTPUT_ALL) == 0
+		|| (usrarg->flags & (F_CHECK_SORTED | F_VERIFY_ONLY | F_SET_MASK | F_INDEX
+				     | F_CHECKPOINT | F_RESUME | F_USER_BUF
+				     | F_LINE_LIMIT)) != 0)) {
+		err = -EINVAL;
+		goto OUT_VALID;
+	}
+
+	/*
+	 * sharding routes whole lines, the per output features of the
+	 * single output are not kept per shard. Range shards need one key
+	 * less than shards
+	 */
+	if ((usrarg->flags & F_SHARD_MASK) != 0
+	    && ((usrarg->flags & F_SHARD_MASK) == F_SHARD_MASK
+		|| usrarg->shards < 2 || usrarg->shards > XMERGE_MAX_SHARDS
+		|| ((usrarg->flags & F_SHARD_RANGE) != 0 && usrarg->shardkeys == NULL)
+		|| (usrarg->flags & (F_USER_BUF | F_COMPRESS_OUT | F_CHECKPOINT
+				     | F_RESUME | F_PROGRESS | F_INDEX
+				     | F_ENCRYPT_OUT | F_CHECKSUM | F_GALLOP
+				     | F_PREALLOC)) != 0)) {
+		err = -EINVAL;
+		goto OUT_VALID;
+	}
+
+	/*
+	 * an incremental merge rewrites the base from one of its lines on,
+	 * it needs the base and the delta as plain sorted files and keeps
+	 * all of the base, the features about the output as a whole do not
+	 * apply to a part of it
+	 */
+	if ((usrarg->flags & F_INCREMENTAL) != 0
+	    && (usrarg->flags & (F_USER_BUF | F_SHARD_MASK | F_KEY_RANGE
+				 | F_SET_MASK | F_VERIFY_ONLY | F_COMPRESS_OUT
+				 | F_DECRYPT_IN | F_ENCRYPT_OUT | F_CHECKPOINT
+				 | F_RESUME | F_INDEX | F_CHECKSUM
+				 | F_LINE_LIMIT | F_PREALLOC)) != 0) {
+		err = -EINVAL;
+		goto OUT_VALID;
+	}
+
+	/*
+	 * front coding needs every line to go through file_line_write after
+	 * the line before it, and restart points where the index points
+	 */
+	if ((usrarg->flags & F_FRONT_CODE) != 0
+	    && ((usrarg->flags & (F_USER_BUF | F_SHARD_MASK | F_GALLOP
+				  | F_CHECKPOINT | F_RESUME | F_INCREMENTAL)) != 0
+		|| ((usrarg->flags & F_INDEX) != 0 && usrarg->restart != 0
+		    && usrarg->restart != usrarg->idxstride))) {
+		err = -EINVAL;
+		goto OUT_VALID;
+	}
+
+	/* a line limit of 0 lines makes no sense */
+	if ((usrarg->flags & F_LINE_LIMIT) != 0 && usrarg->limit == 0) {
+		err = -EINVAL;
+		goto OUT_VALID;
+	}
+
+	/* progress needs somewhere to be published */
+	if ((usrarg->flags & F_PROGRESS) != 0 && usrarg->progress == NULL) {
+		err = -EINVAL;
+		goto OUT_VALID;
+	}
+
+	/*
+	 * the index records offsets of the plain output and is not part of
+	 * a checkpoint
+	 */
+	if ((usrarg->flags & F_INDEX) != 0
+	    && (usrarg->idxfile == NULL || usrarg->idxstride == 0
+		|| (usrarg->flags & (F_COMPRESS_OUT | F_RESUME)) != 0)) {
+		err = -EINVAL;
+		goto OUT_VALID;
+	}
+
+	/* checkpoints need a file, and can not describe a compressed output */
+	if ((usrarg->flags & (F_CHECKPOINT | F_RESUME)) != 0
+	    && (usrarg->ckptfile == NULL
+		|| (usrarg->flags & F_COMPRESS_OUT) != 0)) {
+		err = -EINVAL;
+		goto OUT_VALID;
+	}
+
+	/*
+	 * encrypted merges need the xcrypt key. Encrypted inputs can not be
+	 * binary searched, and checkpoints and the index would keep lines
+	 * of the merge in plain text
+	 */
+	if ((usrarg->flags & (F_DECRYPT_IN | F_ENCRYPT_OUT)) != 0
+	    && (usrarg->key == NULL || usrarg->keylen != MD5_KEY_LENGTH
+		|| (usrarg->flags & (F_CHECKPOINT | F_RESUME | F_INDEX)) != 0)) {
+		err = -EINVAL;
+		goto OUT_VALID;
+	}
+	if ((usrarg->flags & F_DECRYPT_IN) != 0
+	    && (usrarg->flags & F_KEY_RANGE) != 0) {
+		err = -EINVAL;
+		goto OUT_VALID;
+	}
+
+	/*
+	 * a merge into a user buffer has no file behind it to compress,
+	 * encrypt, checkpoint, index or checksum
+	 */
+	if ((usrarg->flags & F_USER_BUF) != 0
+	    && (usrarg->ubuf == NULL || usrarg->ubuflen == 0
+		|| usrarg->cont == NULL
+		|| (usrarg->flags & (F_COMPRESS_OUT | F_CHECKPOINT | F_RESUME
+				     | F_PROGRESS | F_INDEX | F_ENCRYPT_OUT
+				     | F_CHECKSUM | F_PREALLOC | F_WRITEBACK
+				     | F_SYNC)) != 0)) {
+		err = -EINVAL;
+		goto OUT_VALID;
+	}
+
 	/* check if any of the mandatory parameter in the argument is null */
 	if (usrarg->infile1 == NULL || usrarg->infile2 == NULL
-	    || usrarg->outfile == NULL) {
+	    || (usrarg->outfile == NULL
+		&& (usrarg->flags & (F_USER_BUF | F_INCREMENTAL)) == 0)) {
 		err = -EINVAL;
 		goto OUT_VALID;
 	} else {
@@ -274,6 +3255,9 @@ return err;
 
 asmlinkage long
 xmergesort(void *arg) {
+	/* memory used by this merge, taken from the context pool */
+	mergectx *ctx = NULL;
+
 	/* pointer to hold user argument structure */
 	fileinput *finput = NULL;
 
@@ -289,6 +3273,37 @@ xmergesort(void *arg) {
 	/* temp file pointer to hold processed data*/
 	struct file *file_temp = NULL;
 
+	/* file pointer to hold the checkpoint file*/
+	struct file *file_ckpt = NULL;
+
+	/* state needed to take checkpoints while flushing output*/
+	ckptstate *ckpt = NULL;
+
+	/* sparse index written along with the output*/
+	idxstate *idx = NULL;
+
+	/* cipher state of an encrypted merge*/
+	cryptstate *cs = NULL;
+
+	/* key of an encrypted merge, copied from user*/
+	unsigned char key[MD5_KEY_LENGTH];
+
+	/* continuation of a merge into a user buffer*/
+	mergecont *cont = NULL;
+
+	/* path of the output and of the temp file next to it*/
+	char *outname = NULL;
+	char *tmpname = NULL;
+	shardset *shard = NULL;
+
+	/*offset in the base an incremental merge rewrites it from*/
+	loff_t incr_pos = 0;
+	int incr_temp = 0;
+
+	/* bounds of the key range, copied from user*/
+	char *lokey = NULL;
+	char *hikey = NULL;
+
 	/* buffer to hold lines from input file 1*/
 	char *inbuf1 = NULL;
 
@@ -333,6 +3348,12 @@ xmergesort(void *arg) {
 	 */
 	int empty = 0;
 
+	/*
+	 * this variable indicate if file 1 was empty before the first read,
+	 * "empty" can only hold one of the files when both are empty
+	 */
+	int empty1 = 0;
+
 	/*
 	 * this variable will indicate if the comparison needs to be done case sensitive of insensitive
 	 * based on the -i flag given by user
@@ -353,22 +3374,27 @@ xmergesort(void *arg) {
 	int UNIQ_FLAG = 0;
 
 	/*
-	 * this variable to handle file system while writting buffer to files
+	 * input the last lines were taken from with -g, and how many lines
+	 * in a row it gave
 	 */
-	mm_segment_t oldfs;
+	int run_from = 0;
+	int run_len = 0;
 
 	/* this variable is being used to count total number of lines written to output file */
 	int i = 0;
 
-	/* finput stores the argument structure passed by user*/
-	finput = (fileinput *) kmalloc(sizeof(fileinput), GFP_KERNEL);
+	/* all buffers of the merge come from one pooled context*/
+	ctx = ctx_get();
 
 	/* check if memory allocation failed*/
-	if (finput == NULL) {
+	if (ctx == NULL) {
 		err = -ENOMEM;
 		goto OUT;
 	}
 
+	/* finput stores the argument structure passed by user*/
+	finput = &ctx->finput;
+
 	/*Copying argument structure from user*/
 	err = copy_from_user((void *) finput, arg, sizeof(fileinput));
 
@@ -386,21 +3412,16 @@ xmergesort(void *arg) {
 		goto OUT;
 	}
 
-	/*opening input and output files*/
+	/*checking sortedness only, no files are merged*/
+	if ((finput->flags & F_VERIFY_ONLY) != 0) {
+		err = verify_sorted(finput);
+		goto OUT;
+	}
+
+	/*opening input files*/
 	file_in1 = filp_open(finput->infile1, O_RDONLY, 0);
 	file_in2 = filp_open(finput->infile2, O_RDONLY, 0);
-	file_temp = filp_open("temp.txt", O_WRONLY | O_CREAT, 0);
-
-	/*setting permissions same as input file*/
-	file_temp->f_path.dentry->d_inode->i_mode =
-	    file_in1->f_path.dentry->d_inode->i_mode;
-	file_out = filp_open(finput->outfile, O_WRONLY | O_CREAT, 0);
-
-	/*setting permissions same as input file*/
-	file_out->f_path.dentry->d_inode->i_mode =
-	    file_in1->f_path.dentry->d_inode->i_mode;
-	if (!file_in1 || !file_in2 || !file_out || !file_temp || IS_ERR(file_in1)
-	    || IS_ERR(file_in2) || IS_ERR(file_out) || IS_ERR(file_temp)) {
+	if (!file_in1 || !file_in2 || IS_ERR(file_in1) || IS_ERR(file_in2)) {
 		printk(KERN_ERR "open FILE ERROR\n");
 		err = -EACCES;
 		goto OUT;
@@ -415,85 +3436,415 @@ xmergesort(void *arg) {
 		goto OUT;
 	}
 
-	if (file_in1->f_inode == file_out->f_inode) {
-		printk(KERN_ERR "file 1 and output file are same\n");
-		err = -EINVAL;
-		goto OUT;
+	/*outputs of a sharded merge are named after the output*/
+	if ((finput->flags & F_SHARD_MASK) != 0) {
+		outname = strndup_user(finput->outfile, PATH_MAX);
+		if (IS_ERR(outname)) {
+			err = PTR_ERR(outname);
+			outname = NULL;
+			goto OUT;
+		}
+		shard = kzalloc(sizeof(shardset), GFP_KERNEL);
+		if (shard == NULL) {
+			err = -ENOMEM;
+			goto OUT;
+		}
+		err = shard_setup(shard, finput, outname, file_in1, file_in2);
+		if (err < 0)
+			goto OUT;
 	}
 
-	if (file_in2->f_inode == file_out->f_inode) {
-		printk(KERN_ERR "file 2 and output file are same\n");
-		err = -EINVAL;
-		goto OUT;
+	/*
+	 * an incremental merge writes to the base, through a temp file
+	 * named after it unless the delta is appended
+	 */
+	if ((finput->flags & F_INCREMENTAL) != 0) {
+		outname = strndup_user(finput->infile1, PATH_MAX);
+		if (IS_ERR(outname)) {
+			err = PTR_ERR(outname);
+			outname = NULL;
+			goto OUT;
+		}
+		tmpname = kasprintf(GFP_KERNEL, "%s.tmp", outname);
+		if (tmpname == NULL) {
+			err = -ENOMEM;
+			goto OUT;
+		}
+		file_out = filp_open(outname, O_RDWR, 0);
+		if (IS_ERR(file_out)) {
+			printk(KERN_ERR "open FILE ERROR\n");
+			file_out = NULL;
+			err = -EACCES;
+			goto OUT;
+		}
 	}
 
-	/* Input buffer to read from file 1 */
-	inbuf1 = (char *) kmalloc(PAGE_SIZE, GFP_KERNEL);
+	/*a merge into a user buffer, into shards or in place has no output file*/
+	if ((finput->flags & (F_USER_BUF | F_SHARD_MASK | F_INCREMENTAL)) == 0) {
+		/*
+		 * the temp file is named after the output, so merges into
+		 * different outputs can run at the same time, and a resume
+		 * finds it again
+		 */
+		outname = strndup_user(finput->outfile, PATH_MAX);
+		if (IS_ERR(outname)) {
+			err = PTR_ERR(outname);
+			outname = NULL;
+			goto OUT;
+		}
+		tmpname = kasprintf(GFP_KERNEL, "%s.tmp", outname);
+		if (tmpname == NULL) {
+			err = -ENOMEM;
+			goto OUT;
+		}
 
-	/*checking for error in assigning buffer memory*/
-	if (inbuf1 == NULL) {
-		err = -ENOMEM;
-		goto OUT;
-	}
+		/*
+		 * opening output files. A temp file left by an earlier merge
+		 * is emptied, so none of it ends up in this output, unless
+		 * this merge resumes from it
+		 */
+		file_temp = filp_open(tmpname, O_RDWR | O_CREAT
+				      | ((finput->flags & F_RESUME) ? 0 : O_TRUNC), 0);
+		file_out = filp_open(finput->outfile, O_WRONLY | O_CREAT, 0);
+		if (!file_out || !file_temp || IS_ERR(file_out) || IS_ERR(file_temp)) {
+			printk(KERN_ERR "open FILE ERROR\n");
+			err = -EACCES;
+			goto OUT;
+		}
 
-	/*input buffer to read from file 2*/
-	inbuf2 = (char *) kmalloc(PAGE_SIZE, GFP_KERNEL);
+		/*setting permissions same as input file*/
+		file_temp->f_path.dentry->d_inode->i_mode =
+		    file_in1->f_path.dentry->d_inode->i_mode;
+		file_out->f_path.dentry->d_inode->i_mode =
+		    file_in1->f_path.dentry->d_inode->i_mode;
 
-	/*checking for error in assigning buffer memory*/
-	if (inbuf2 == NULL) {
-		err = -ENOMEM;
-		goto OUT;
+		if (file_in1->f_inode == file_out->f_inode) {
+			printk(KERN_ERR "file 1 and output file are same\n");
+			err = -EINVAL;
+			goto OUT;
+		}
+
+		if (file_in2->f_inode == file_out->f_inode) {
+			printk(KERN_ERR "file 2 and output file are same\n");
+			err = -EINVAL;
+			goto OUT;
+		}
 	}
 
+	/* Input buffers to hold current line of file 1 and file 2 */
+	inbuf1 = ctx->inbuf1;
+	inbuf2 = ctx->inbuf2;
+
 	/*output buffer to store the last line that been written to output*/
-	lastout = (char *) kmalloc(PAGE_SIZE, GFP_KERNEL);
+	lastout = ctx->lastout;
 
-	/*checking for error in assigning buffer memory*/
-	if (lastout == NULL) {
-		err = -ENOMEM;
-		goto OUT;
+	/*out buffer to store the merged data temporarily*/
+	outbuf = &ctx->outbuf;
+	outbuf->shard = shard;
+
+	/*crc32c of the output, folded in as each block is written*/
+	if ((finput->flags & F_CHECKSUM) != 0) {
+		outbuf->sum = 1;
+		outbuf->crc = ~0;
 	}
 
-	/*Creating a out buffer of page size bytes to store the merged data temporarily*/
-	outbuf = (outputbuf *) kmalloc(sizeof(outputbuf), GFP_KERNEL);
-	if (outbuf == NULL) {
-		err = -ENOMEM;
-		goto OUT;
+	/*compress the output stream block by block if requested*/
+	if ((finput->flags & F_COMPRESS_OUT) != 0) {
+		err = zoutput_setup(outbuf);
+		if (err < 0)
+			goto OUT;
 	}
-	outbuf->buffer = (char *) kmalloc(MAX_OUTBUF_SIZE, GFP_KERNEL);
-	if (outbuf->buffer == NULL) {
-		err = -ENOMEM;
-		goto OUT;
+
+	/*chunk buffers of both files, reset empty by ctx_get*/
+	inputbuf1 = &ctx->inputbuf1;
+	inputbuf2 = &ctx->inputbuf2;
+
+	/*
+	 * encrypted merge, the inputs are decrypted as they are read and
+	 * the output is encrypted as it is flushed, see cipher_read and
+	 * cipher_write
+	 */
+	if ((finput->flags & (F_DECRYPT_IN | F_ENCRYPT_OUT)) != 0) {
+		if (copy_from_user(key, finput->key, MD5_KEY_LENGTH) != 0) {
+			err = -EFAULT;
+			goto OUT;
+		}
+		cs = (cryptstate *) kzalloc(sizeof(cryptstate), GFP_KERNEL);
+		if (cs == NULL) {
+			err = -ENOMEM;
+			goto OUT;
+		}
+		err = cipher_setup(cs, key);
+		memset(key, 0, MD5_KEY_LENGTH);
+		if (err < 0)
+			goto OUT;
+	}
+	if ((finput->flags & F_DECRYPT_IN) != 0) {
+		err = cipher_check(file_in1, inputbuf1, cs);
+		if (err < 0)
+			goto OUT;
+		err = cipher_check(file_in2, inputbuf2, cs);
+		if (err < 0)
+			goto OUT;
 	}
-	outbuf->currsize = 0;
-	outbuf->availsize = MAX_OUTBUF_SIZE;
 
-	inputbuf1 = (inputbuf *) kmalloc(sizeof(inputbuf), GFP_KERNEL);
-	if (inputbuf1 == NULL) {
-		err = -ENOMEM;
+	/*inflate file 1 on the fly if it is compressed*/
+	err = zinput_detect(file_in1, inputbuf1);
+	if (err < 0)
 		goto OUT;
-	}
-	inputbuf1->buffer = (char *) kmalloc(MAX_INBUF_SIZE, GFP_KERNEL);
-	if (inputbuf1->buffer == NULL) {
-		err = -ENOMEM;
+
+	/*inflate file 2 on the fly if it is compressed*/
+	err = zinput_detect(file_in2, inputbuf2);
+	if (err < 0)
 		goto OUT;
-	}
-	inputbuf1->start = -1; /*-1 indicate buffer is empty*/
 
-	inputbuf1->size = 0;
+	/*decode front coded inputs, plain or inflated*/
+	err = fc_detect(file_in1, inputbuf1);
+	if (err < 0)
+		goto OUT;
+	err = fc_detect(file_in2, inputbuf2);
+	if (err < 0)
+		goto OUT;
 
-	inputbuf2 = (inputbuf *) kmalloc(sizeof(inputbuf), GFP_KERNEL);
-	if (inputbuf2 == NULL) {
-		err = -ENOMEM;
+	/*
+	 * positions in a front coded input can not be taken from its lines,
+	 * what needs them can not read one
+	 */
+	if ((inputbuf1->fc || inputbuf2->fc)
+	    && (finput->flags & (F_CHECKPOINT | F_RESUME | F_USER_BUF)) != 0) {
+		printk(KERN_ERR "front coded input can not be resumed\n");
+		err = -EINVAL;
 		goto OUT;
 	}
-	inputbuf2->buffer = (char *) kmalloc(MAX_INBUF_SIZE, GFP_KERNEL);
-	if (inputbuf2->buffer == NULL) {
-		err = -ENOMEM;
-		goto OUT;
+
+	/*plain inputs are read in place from the page cache*/
+	if (page_reads) {
+		inputbuf1->pgread = (inputbuf1->zstrm == NULL && inputbuf1->cs == NULL
+				     && !inputbuf1->fc
+				     && file_in1->f_mapping->a_ops->readpage != NULL);
+		inputbuf2->pgread = (inputbuf2->zstrm == NULL && inputbuf2->cs == NULL
+				     && !inputbuf2->fc
+				     && file_in2->f_mapping->a_ops->readpage != NULL);
+	}
+
+	/*progress is published from the flush path when requested*/
+	if ((finput->flags & F_PROGRESS) != 0) {
+		outbuf->progress = finput->progress;
+		outbuf->src1 = inputbuf1;
+		outbuf->src2 = inputbuf2;
+	}
+
+	/*
+	 * key range, both inputs are binary searched for the lower key and
+	 * stop at the upper key, so only the lines in range are read
+	 */
+	if ((finput->flags & F_KEY_RANGE) != 0) {
+		if (finput->lokey) {
+			lokey = strndup_user(finput->lokey, PAGE_SIZE);
+			if (IS_ERR(lokey)) {
+				err = PTR_ERR(lokey);
+				lokey = NULL;
+				goto OUT;
+			}
+		}
+		if (finput->hikey) {
+			hikey = strndup_user(finput->hikey, PAGE_SIZE);
+			if (IS_ERR(hikey)) {
+				err = PTR_ERR(hikey);
+				hikey = NULL;
+				goto OUT;
+			}
+		}
+		err = range_setup(file_in1, inputbuf1, lokey, hikey,
+				  (finput->flags & F_CASE_INSEN) != 0);
+		if (err < 0)
+			goto OUT;
+		err = range_setup(file_in2, inputbuf2, lokey, hikey,
+				  (finput->flags & F_CASE_INSEN) != 0);
+		if (err < 0)
+			goto OUT;
+	}
+
+	/*
+	 * incremental merge, only the base from the first line of the delta
+	 * on is merged. If that is the end of the base the delta is written
+	 * straight after it, otherwise the merged suffix goes to the temp
+	 * file and is copied back over the base at the end
+	 */
+	if ((finput->flags & F_INCREMENTAL) != 0) {
+		incr_pos = incr_setup(file_in1, inputbuf1, file_in2, inputbuf2,
+				      (finput->flags & F_CASE_INSEN) != 0);
+		if (incr_pos < 0) {
+			err = incr_pos;
+			goto OUT;
+		}
+		if (incr_pos == i_size_read(file_inode(file_in1))) {
+			inputbuf1->eof = 1;
+			file_temp = file_out;
+			file_out = NULL;
+			err = incr_append(file_temp, incr_pos);
+			if (err < 0)
+				goto OUT;
+		} else {
+			/*a temp file left by a failed copy holds part of the base*/
+			file_temp = filp_open(tmpname, O_RDWR | O_CREAT | O_EXCL, 0);
+			if (IS_ERR(file_temp)) {
+				err = PTR_ERR(file_temp);
+				file_temp = NULL;
+				if (err == -EEXIST) {
+					printk(KERN_ERR "%s exists, an earlier merge did not finish\n",
+					       tmpname);
+					goto OUT;
+				}
+				printk(KERN_ERR "open FILE ERROR\n");
+				err = -EACCES;
+				goto OUT;
+			}
+			incr_temp = 1;
+			file_temp->f_path.dentry->d_inode->i_mode =
+			    file_in1->f_path.dentry->d_inode->i_mode;
+		}
+	}
+
+	/*sparse index of the output, entries are added as lines are written*/
+	if ((finput->flags & F_INDEX) != 0) {
+		idx = (idxstate *) kzalloc(sizeof(idxstate), GFP_KERNEL);
+		if (idx == NULL) {
+			err = -ENOMEM;
+			goto OUT;
+		}
+		err = index_open(idx, finput->idxfile, finput->idxstride);
+		if (err < 0)
+			goto OUT;
+		outbuf->idx = idx;
+	}
+
+	/*
+	 * checkpoint the merge on every flush, and continue from the
+	 * checkpoint if resume is asked. Offsets into a compressed
+	 * stream can not be seeked to, so those merges can't be resumed
+	 */
+	if ((finput->flags & (F_CHECKPOINT | F_RESUME)) != 0) {
+		if (inputbuf1->zstrm || inputbuf2->zstrm) {
+			printk(KERN_ERR "can not checkpoint compressed input\n");
+			err = -EINVAL;
+			goto OUT;
+		}
+		ckpt = (ckptstate *) kzalloc(sizeof(ckptstate), GFP_KERNEL);
+		if (ckpt == NULL) {
+			err = -ENOMEM;
+			goto OUT;
+		}
+		file_ckpt = filp_open(finput->ckptfile, O_RDWR | O_CREAT, 0600);
+		if (!file_ckpt || IS_ERR(file_ckpt)) {
+			printk(KERN_ERR "open checkpoint FILE ERROR\n");
+			file_ckpt = NULL;
+			err = -EACCES;
+			goto OUT;
+		}
+		ckpt->filp = file_ckpt;
+		ckpt->inputbuf1 = inputbuf1;
+		ckpt->inputbuf2 = inputbuf2;
+		ckpt->inbuf1 = &inbuf1;
+		ckpt->inbuf2 = &inbuf2;
+		ckpt->flags = finput->flags;
+		outbuf->ckpt = ckpt;
+
+		if ((finput->flags & F_RESUME) != 0) {
+			err = ckpt_resume(ckpt, file_in1, file_in2, file_temp,
+					  outbuf, lastout);
+			if (err < 0)
+				goto OUT;
+			i = err;
+			if (outbuf->sum) {
+				err = checksum_prefix(file_temp, outbuf);
+				if (err < 0)
+					goto OUT;
+			}
+		} else {
+			/*
+			 * the temp file was emptied when opened, start from
+			 * empty slots too so a resume never finds a checkpoint
+			 * of an earlier merge
+			 */
+			err = file_truncate(file_ckpt, 0);
+			if (err < 0)
+				goto OUT;
+		}
+	}
+
+	/*encrypted output starts with the preamble, data is encrypted on flush*/
+	if ((finput->flags & F_ENCRYPT_OUT) != 0) {
+		err = cipher_preamble(file_temp, outbuf, cs);
+		if (err < 0)
+			goto OUT;
+	}
+
+	/*
+	 * front coded output, the header goes through the output buffer so it
+	 * is compressed and encrypted with the lines
+	 */
+	if ((finput->flags & F_FRONT_CODE) != 0) {
+		if (finput->restart)
+			outbuf->restart = finput->restart;
+		else if ((finput->flags & F_INDEX) != 0)
+			outbuf->restart = finput->idxstride;
+		else
+			outbuf->restart = XFC_RESTART;
+		memcpy(outbuf->buffer, XFC_MAGIC, XFC_MAGIC_LEN);
+		outbuf->buffer[XFC_MAGIC_LEN] = XFC_VERSION;
+		outbuf->currsize = XFC_HEADER_LEN;
+		outbuf->availsize = MAX_OUTBUF_SIZE - XFC_HEADER_LEN;
+	}
+
+	/*
+	 * allocate the whole output up front so it is not grown a buffer at
+	 * a time, the sum of the inputs is what a merge keeping all lines
+	 * writes. Filesystems without fallocate just grow the file as before
+	 */
+	if ((finput->flags & F_PREALLOC) != 0) {
+		err = vfs_fallocate(file_temp, 0, 0,
+				    i_size_read(file_inode(file_in1))
+				    + i_size_read(file_inode(file_in2)));
+		if (err < 0 && err != -EOPNOTSUPP)
+			goto OUT;
+	}
+
+	/*writeback starts from where the merge starts writing*/
+	if ((finput->flags & F_WRITEBACK) != 0 && writeback_kb > 0 && file_temp) {
+		outbuf->wbchunk = (loff_t) writeback_kb << 10;
+		outbuf->wbpos = file_temp->f_pos;
+	}
+
+	/*
+	 * only the first lines are wanted, the merge and the tail loops stop
+	 * at the first line over the limit. With a lower key the inputs are
+	 * seeked first, so the cost follows the limit, not the file sizes
+	 */
+	if ((finput->flags & F_LINE_LIMIT) != 0)
+		outbuf->limit = finput->limit;
+
+	/*merge into a user buffer, continuing where the last call stopped*/
+	if ((finput->flags & F_USER_BUF) != 0) {
+		cont = (mergecont *) kmalloc(sizeof(mergecont), GFP_KERNEL);
+		if (cont == NULL) {
+			err = -ENOMEM;
+			goto OUT;
+		}
+		if (copy_from_user(cont, finput->cont, sizeof(mergecont)) != 0) {
+			err = -EFAULT;
+			goto OUT;
+		}
+		outbuf->ubuf = finput->ubuf;
+		outbuf->ulen = finput->ubuflen;
+		if (cont->more) {
+			err = cont_resume(cont, file_in1, file_in2, inputbuf1,
+					  inputbuf2, outbuf, lastout);
+			if (err < 0)
+				goto OUT;
+			i = err;
+		}
 	}
-	inputbuf2->start = -1; /*-1 indicate buffer in empty*/
-	inputbuf2->size = 0;
 
 	/*Reading first line of file 1 in buffer setting empty if file is empty*/
 	err = file_line_read(file_in1, inbuf1, inputbuf1);
@@ -503,6 +3854,7 @@ xmergesort(void *arg) {
 			goto OUT;
 		}
 		empty = 1;
+		empty1 = 1;
 	}
 
 	/*Reading first line of file 2 in buffer setting empty if file is empty*/
@@ -533,6 +3885,19 @@ xmergesort(void *arg) {
 	if ((finput->flags & F_OUTPUT_UNIQ) != 0)
 		UNIQ_FLAG = 1;
 
+	/*
+	 * set operations use their own lockstep walk over both inputs
+	 */
+	if ((finput->flags & F_SET_MASK) != 0) {
+		err = setop_merge(file_in1, file_in2, file_temp, &inbuf1, &inbuf2,
+				  inputbuf1, inputbuf2, outbuf, &lastout,
+				  finput->flags, empty1, empty == 2);
+		if (err < 0 && !outbuf->stop)
+			goto OUT;
+		i = outbuf->lines;
+		goto FLUSH_OUT;
+	}
+
 	/*
 	 * starting of the while loop for sorting,
 	 * this will go on until one of the file is empty
@@ -663,21 +4028,49 @@ xmergesort(void *arg) {
 		 * write == 0 --> do nothing
 		 */
 		if (write == 1) {
-			err = file_line_write(file_temp, inbuf1, strlen(inbuf1), outbuf, lastout);
+			err = file_line_write(file_temp, &inbuf1, strlen(inbuf1), outbuf, &lastout);
 			if (err < 0) {
+				if (outbuf->stop)
+					goto FLUSH_OUT;
 				err = -EFAULT;
 				goto OUT;
 			}
 			++i;
 		} else if (write == 2) {
-			err = file_line_write(file_temp, inbuf2, strlen(inbuf2), outbuf, lastout);
+			err = file_line_write(file_temp, &inbuf2, strlen(inbuf2), outbuf, &lastout);
 			if (err < 0) {
+				if (outbuf->stop)
+					goto FLUSH_OUT;
 				err = -EFAULT;
 				goto OUT;
 			}
 			++i;
 		}
 
+		/*
+		 * with -g, once one input wins GALLOP_MIN times in a row its
+		 * buffered lines that still sort first are copied as one block
+		 */
+		if ((finput->flags & F_GALLOP) != 0 && write != 0 && write == load) {
+			if (write == run_from) {
+				run_len++;
+			} else {
+				run_from = write;
+				run_len = 1;
+			}
+			if (run_len >= GALLOP_MIN) {
+				if (write == 1)
+					err = gallop_run(file_in1, inputbuf1, inbuf2, INSEN_FLAG,
+							 file_temp, outbuf, &lastout);
+				else
+					err = gallop_run(file_in2, inputbuf2, inbuf1, INSEN_FLAG,
+							 file_temp, outbuf, &lastout);
+				if (err < 0)
+					goto OUT;
+				i += err;
+			}
+		}
+
 		/*
 		 * PART 3 :
 		 * load inbuf1 or inbuf2 or both based on value of "load" variable
@@ -751,8 +4144,10 @@ xmergesort(void *arg) {
 			/*PART 2*/
 
 			if (write == 1) {
-				err = file_line_write(file_temp, inbuf1, strlen(inbuf1), outbuf, lastout);
+				err = file_line_write(file_temp, &inbuf1, strlen(inbuf1), outbuf, &lastout);
 				if (err < 0) {
+					if (outbuf->stop)
+						goto FLUSH_OUT;
 					err = -EFAULT;
 					goto OUT;
 				}
@@ -810,8 +4205,10 @@ xmergesort(void *arg) {
 
 			/*PART 2*/
 			if (write == 2) {
-				err = file_line_write(file_temp, inbuf2, strlen(inbuf2), outbuf, lastout);
+				err = file_line_write(file_temp, &inbuf2, strlen(inbuf2), outbuf, &lastout);
 				if (err < 0) {
+					if (outbuf->stop)
+						goto FLUSH_OUT;
 					err = -EFAULT;
 					goto OUT;
 				}
@@ -824,11 +4221,55 @@ xmergesort(void *arg) {
 		}
 	}
 
+FLUSH_OUT:
+	/*every shard is flushed and renamed on its own*/
+	if (shard) {
+		err = shard_finish(shard, finput);
+		if (err < 0)
+			goto OUT;
+		err = copy_to_user(finput->data, &i, 2);
+		if (err != 0)
+			err = -EFAULT;
+		goto OUT;
+	}
+
 	/*flushing rest of the out buffer to file*/
-	oldfs = get_fs();
-	set_fs(KERNEL_DS);
-	vfs_write(file_temp, outbuf->buffer, outbuf->currsize, &file_temp->f_pos);
-	set_fs(oldfs);
+	err = flush_out_buffer(file_temp, outbuf, 1);
+	if (err < 0) {
+		err = -EFAULT;
+		goto OUT;
+	}
+	err = progress_update(outbuf, file_temp, 1);
+	if (err < 0)
+		goto OUT;
+	if (idx) {
+		err = index_finish(idx, outbuf->lines);
+		if (err < 0)
+			goto OUT;
+	}
+
+	/*the preallocated output is cut to what was written*/
+	if ((finput->flags & F_PREALLOC) != 0) {
+		err = file_truncate(file_temp, file_temp->f_pos);
+		if (err < 0)
+			goto OUT;
+	}
+
+	/*the data has to be on disk before the rename makes it visible*/
+	if ((finput->flags & F_SYNC) != 0) {
+		err = vfs_fsync(file_temp, 1);
+		if (err < 0)
+			goto OUT;
+	}
+
+	/*returning the crc32c of the whole output file*/
+	if (outbuf->sum) {
+		outbuf->crc = ~outbuf->crc;
+		if (copy_to_user(finput->checksum, &outbuf->crc, sizeof(u32)) != 0) {
+			err = -EFAULT;
+			goto OUT;
+		}
+	}
 
 	/*copying the number of lines written to output file*/
 	err = copy_to_user(finput->data, &i, 2);
@@ -838,46 +4279,105 @@ xmergesort(void *arg) {
 		goto OUT;
 	}
 
+	/*a merge into a user buffer ends with where it stopped, no file to rename*/
+	if (cont) {
+		err = cont_finish(cont, inputbuf1, inbuf1, inputbuf2, inbuf2,
+				  outbuf, lastout);
+		if (err < 0)
+			goto OUT;
+		if (copy_to_user(finput->cont, cont, sizeof(mergecont)) != 0)
+			err = -EFAULT;
+		goto OUT;
+	}
+
+	/*an appended delta is in place already, a merged suffix is copied back*/
+	if ((finput->flags & F_INCREMENTAL) != 0) {
+		incr_temp = 0;
+		if (file_out)
+			err = incr_finish(file_temp, file_out, incr_pos, outbuf->buffer,
+					  (finput->flags & F_SYNC) != 0);
+		goto OUT;
+	}
+
 	/*Renaming the temp file to given output file*/
 
 	lock_rename(file_out->f_path.dentry->d_parent, file_temp->f_path.dentry->d_parent);
 
-	vfs_rename(file_temp->f_path.dentry->d_parent->d_inode, file_temp->f_path.dentry, file_out->f_path.dentry->d_parent->d_inode, file_out->f_path.dentry, NULL, RENAME_NOREPLACE);
+	/*the output was opened with O_CREAT, so the rename replaces it*/
+	err = vfs_rename(file_temp->f_path.dentry->d_parent->d_inode, file_temp->f_path.dentry, file_out->f_path.dentry->d_parent->d_inode, file_out->f_path.dentry, NULL, 0);
 
 	unlock_rename(file_out->f_path.dentry->d_parent, file_temp->f_path.dentry->d_parent);
 
-OUT: if (inbuf1) {
-		kfree(inbuf1);
-		inbuf1 = NULL;
-	}
-	if (inbuf2) {
-		kfree(inbuf2);
-		inbuf2 = NULL;
-	}
-	if (outbuf && outbuf->buffer) {
-		kfree(outbuf->buffer);
-		outbuf = NULL;
+	/*a sidecar must not vouch for an output that is not in place*/
+	if (err < 0) {
+		printk(KERN_ERR "rename of the output failed\n");
+		goto OUT;
 	}
-	if (lastout) {
-		kfree(lastout);
-		lastout = NULL;
+
+	/*
+	 * the output is published, invalidate the checkpoint. Until the
+	 * rename succeeds it is the only way to resume the merge
+	 */
+	if (file_ckpt)
+		file_truncate(file_ckpt, 0);
+
+	/*sidecar checksum file, written once the output is in place*/
+	if (outbuf->sum && finput->sumfile) {
+		err = checksum_sidecar(finput->sumfile, outbuf->crc, finput->outfile);
+		if (err < 0)
+			goto OUT;
 	}
-	if (file_in1)
+
+OUT: zinput_release(inputbuf1);
+	zinput_release(inputbuf2);
+	page_release(inputbuf1);
+	page_release(inputbuf2);
+	zoutput_release(outbuf);
+	if (file_in1 && !IS_ERR(file_in1))
 		filp_close(file_in1, NULL);
-	if (file_in2)
+	if (file_in2 && !IS_ERR(file_in2))
 		filp_close(file_in2, NULL);
-	if (file_out)
+	if (file_out && !IS_ERR(file_out))
 		filp_close(file_out, NULL);
-	if (finput) {
-		kfree(finput);
-		finput = NULL;
+	/*the base is untouched until incr_finish, its temp file can go*/
+	if (incr_temp)
+		file_unlink(file_temp);
+	if (file_temp && !IS_ERR(file_temp))
+		filp_close(file_temp, NULL);
+	if (file_ckpt)
+		filp_close(file_ckpt, NULL);
+	if (ckpt) {
+		kfree(ckpt);
+		ckpt = NULL;
 	}
+	index_close(idx);
+	cipher_release(cs);
+	kfree(lokey);
+	kfree(hikey);
+	kfree(outname);
+	kfree(tmpname);
+	shard_release(shard);
+	kfree(cont);
+	ctx_put(ctx);
 	return err;
 }
 
+EXPORT_SYMBOL(xmergesort);
+
 /*Entry Function of xmergesort module*/
 static int __init init_sys_xmergesort(void)
 {
+	mergectx *ctx;
+	int n;
+
+	/*preallocating merge contexts, calls allocate their own if short*/
+	for (n = 0; n < ctx_pool_size; n++) {
+		ctx = ctx_alloc();
+		if (ctx == NULL)
+			break;
+		list_add(&ctx->list, &ctx_pool);
+		ctx_pool_count++;
+	}
 	printk(KERN_INFO "installed new sys_xmergesort module\n");
 	if (sysptr == NULL)
 	sysptr = xmergesort;
@@ -887,8 +4387,15 @@ static int __init init_sys_xmergesort(void)
 /*Exit function of xmergesort module*/
 static void __exit exit_sys_xmergesort(void)
 {
-	if (sysptr != NULL)
+	mergectx *ctx, *tmp;
+
+	if (sysptr == xmergesort)
 	sysptr = NULL;
+	list_for_each_entry_safe(ctx, tmp, &ctx_pool, list) {
+		list_del(&ctx->list);
+		ctx_free(ctx);
+	}
+	ctx_pool_count = 0;
 	printk(KERN_INFO "removed sys_xmergesort module\n");
 }
 
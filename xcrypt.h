@@ -0,0 +1,68 @@
+#ifndef _XCRYPT_H
+#define _XCRYPT_H
+
+#include <linux/crypto.h>
+#include <linux/scatterlist.h>
+#include <linux/string.h>
+
+/*
+ * Format of a file encrypted by xcrypt, shared by every module reading
+ * or writing one: a SHA1 preamble of the key followed by the data
+ * encrypted with ctr(aes), the counter starting at CRYPT_IV for the
+ * first byte after the preamble
+ */
+#define MD5_KEY_LENGTH 16
+#define SHA_KEY_LENGTH 20
+#define CRYPT_IV "\x12\x34\x56\x78\x90\xab\xcd\xef\x12\x34\x56\x78\x90\xab\xcd\xef"
+#define CRYPT_IV_SIZE 16
+
+/*
+ * sha : preamble of a key
+ * @hash : filled with SHA_KEY_LENGTH bytes
+ * @plaintext : the key
+ */
+static inline void sha(unsigned char *hash, char *plaintext)
+{
+	struct scatterlist sg;
+	struct crypto_hash *tfm;
+	struct hash_desc desc;
+
+	memset(hash, 0x00, SHA_KEY_LENGTH);
+
+	tfm = crypto_alloc_hash("sha1", 0, CRYPTO_ALG_ASYNC);
+
+	desc.tfm = tfm;
+	desc.flags = 0;
+
+	sg_init_one(&sg, plaintext, 10);
+	crypto_hash_init(&desc);
+
+	crypto_hash_update(&desc, &sg, 10);
+	crypto_hash_final(&desc, hash);
+	crypto_free_hash(tfm);
+}
+
+/*
+ * ctr_iv_at : counter block for a byte offset of the data
+ * @iv : filled with the counter block
+ * @offset : offset from the start of the encrypted data, block aligned
+ *
+ * CTR uses one counter value per AES block, so the counter of any
+ * block is the initial IV plus its block number, big endian
+ */
+static inline void ctr_iv_at(u8 *iv, loff_t offset)
+{
+	u64 blocks = offset / CRYPT_IV_SIZE;
+	unsigned int carry = 0;
+	int i;
+
+	memcpy(iv, CRYPT_IV, CRYPT_IV_SIZE);
+	for (i = CRYPT_IV_SIZE - 1; i >= 0 && (blocks || carry); i--) {
+		carry += iv[i] + (blocks & 0xff);
+		iv[i] = carry & 0xff;
+		carry >>= 8;
+		blocks >>= 8;
+	}
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include <asm/unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <sys/syscall.h>
 #include <unistd.h>
@@ -15,15 +16,17 @@ int main(int argc, char **argv)
 {
 	int err;
 	int option;
+	unsigned int k;
+	char *key;
 	fileinput *input;
-	input = malloc(sizeof(struct input));
+	input = calloc(1, sizeof(struct input));
 	if (!input) {
 		printf("[main] : MALLOC FAILED");
 		err = -ENOMEM;
 		goto out_ok;
 	}
 
-	while ((option = getopt(argc, argv, "uaitd")) != -1) {
+	while ((option = getopt(argc, argv, "uaitdc12xzk:rpvn:s:L:H:DEK:CS:b:l:gPWFR:N:If:")) != -1) {
 		switch (option) {
 		case 'u':
 			input->flags = input->flags | 0x01;
@@ -40,6 +43,114 @@ int main(int argc, char **argv)
 		case 'd':
 			input->flags = input->flags | 0x20;
 			break;
+		case 'c':
+			input->flags = input->flags | 0x40;
+			break;
+		case '1':
+			input->flags = input->flags | 0x80;
+			break;
+		case '2':
+			input->flags = input->flags | 0x100;
+			break;
+		case 'x':
+			input->flags = input->flags | 0x200;
+			break;
+		case 'z':
+			input->flags = input->flags | 0x400;
+			break;
+		case 'k':
+			input->flags = input->flags | 0x800;
+			input->ckptfile = optarg;
+			break;
+		case 'r':
+			input->flags = input->flags | 0x1000;
+			break;
+		case 'p':
+			input->flags = input->flags | 0x2000;
+			input->progress = calloc(1, sizeof(mergeprogress));
+			break;
+		case 'v':
+			input->flags = input->flags | 0x4000;
+			input->check = calloc(1, sizeof(sortcheck));
+			break;
+		case 'n':
+			input->flags = input->flags | 0x8000;
+			input->idxfile = optarg;
+			if (input->idxstride == 0)
+				input->idxstride = 64;
+			break;
+		case 's':
+			input->idxstride = atoi(optarg);
+			break;
+		case 'L':
+			input->flags = input->flags | 0x10000;
+			input->lokey = optarg;
+			break;
+		case 'H':
+			input->flags = input->flags | 0x10000;
+			input->hikey = optarg;
+			break;
+		case 'D':
+			input->flags = input->flags | 0x20000;
+			break;
+		case 'E':
+			input->flags = input->flags | 0x40000;
+			break;
+		case 'K':
+			input->keylen = 16;
+			input->key = calloc(1, input->keylen);
+			if (input->key)
+				strncpy((char *) input->key, optarg, input->keylen);
+			break;
+		case 'S':
+			input->sumfile = optarg;
+			/* fall through, a sidecar implies the checksum */
+		case 'C':
+			input->flags = input->flags | 0x80000;
+			if (input->checksum == NULL)
+				input->checksum = calloc(1, sizeof(unsigned int));
+			break;
+		case 'b':
+			input->flags = input->flags | 0x100000;
+			input->ubuflen = strtoull(optarg, NULL, 10);
+			break;
+		case 'l':
+			input->flags = input->flags | 0x200000;
+			input->limit = atoi(optarg);
+			break;
+		case 'g':
+			input->flags = input->flags | 0x400000;
+			break;
+		case 'P':
+			input->flags = input->flags | 0x800000;
+			break;
+		case 'W':
+			input->flags = input->flags | 0x1000000;
+			break;
+		case 'F':
+			input->flags = input->flags | 0x2000000;
+			break;
+		case 'R':
+			/* comma separated keys, one shard more than keys */
+			input->flags = input->flags | 0x4000000;
+			input->shardkeys = calloc(XMERGE_MAX_SHARDS, sizeof(char *));
+			input->shards = 1;
+			for (key = strtok(optarg, ","); key && input->shards < XMERGE_MAX_SHARDS;
+			     key = strtok(NULL, ","))
+				input->shardkeys[input->shards++ - 1] = key;
+			break;
+		case 'N':
+			input->flags = input->flags | 0x8000000;
+			input->shards = atoi(optarg);
+			break;
+		case 'I':
+			input->flags = input->flags | 0x10000000;
+			break;
+		case 'f':
+			/* restart interval, 0 for the default */
+			input->flags = input->flags | 0x20000000;
+			input->restart = atoi(optarg);
+			break;
 		default:
 			err = -1;
 			printf("[main] : Invalid option %c\n", option);
@@ -47,6 +158,70 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if ((input->flags & 0x4000) != 0) {
+		if ((optind + 1) > argc) {
+			printf("[main] : Inappropriate number of arguments\n");
+			goto out;
+		}
+		input->infile1 = argv[optind];
+		err = syscall(__NR_xmergesort, (void *) input);
+		if (err != 0) {
+			perror("[sys_call] ");
+		} else if (input->check->offset < 0) {
+			printf("%s is sorted\n", input->infile1);
+		} else {
+			printf("%s is not sorted at line %llu (byte %lld)\n",
+			       input->infile1, input->check->line,
+			       input->check->offset);
+			err = 1;
+		}
+		goto out;
+	}
+
+	/* merge into memory, a buffer at a time, and print it */
+	if ((input->flags & 0x100000) != 0) {
+		if ((optind + 2) > argc) {
+			printf("[main] : Inappropriate number of arguments\n");
+			goto out;
+		}
+		input->infile1 = argv[optind];
+		input->infile2 = argv[optind + 1];
+		input->data = (unsigned int *) malloc(sizeof(int));
+		input->ubuf = malloc(input->ubuflen);
+		input->cont = calloc(1, sizeof(mergecont));
+		if (!input->ubuf || !input->cont) {
+			err = -ENOMEM;
+			goto out;
+		}
+		do {
+			err = syscall(__NR_xmergesort, (void *) input);
+			if (err != 0) {
+				perror("[sys_call] ");
+				goto out;
+			}
+			fwrite(input->ubuf, 1, input->cont->filled, stdout);
+		} while (input->cont->more);
+		goto out;
+	}
+
+	/* merge a delta into a base in place, no output file */
+	if ((input->flags & 0x10000000) != 0) {
+		if ((optind + 2) > argc) {
+			printf("[main] : Inappropriate number of arguments\n");
+			goto out;
+		}
+		input->infile1 = argv[optind];
+		input->infile2 = argv[optind + 1];
+		input->data = (unsigned int *) malloc(sizeof(int));
+		err = syscall(__NR_xmergesort, (void *) input);
+		if (err != 0)
+			perror("[sys_call] ");
+		else if ((input->flags & 0x20) != 0)
+			printf("Number of lines merged into %s : %d\n",
+			       input->infile1, *input->data);
+		goto out;
+	}
+
 	if ((optind + 3) > argc) {
 		printf("[main] : Inappropriate number of arguments\n");
 		goto out;
@@ -55,6 +230,8 @@ int main(int argc, char **argv)
 	input->infile1 = argv[optind + 1];
 	input->infile2 = argv[optind + 2];
 	input->data = (unsigned int *) malloc(sizeof(int));
+	if (input->shards)
+		input->shardcounts = calloc(input->shards, sizeof(unsigned int));
 
 	err = syscall(__NR_xmergesort, (void *) input);
 	if (err == 0) {
@@ -62,6 +239,19 @@ int main(int argc, char **argv)
 			printf("Number of lines written to out file : %d\n",
 			       *input->data);
 		}
+		if ((input->flags & 0x2000) != 0 && input->progress) {
+			printf("Merged %llu + %llu bytes into %llu bytes\n",
+			       input->progress->in1_bytes,
+			       input->progress->in2_bytes,
+			       input->progress->out_bytes);
+		}
+		if ((input->flags & 0x80000) != 0 && input->checksum) {
+			printf("crc32c of out file : %08x\n", *input->checksum);
+		}
+		for (k = 0; input->shardcounts && k < input->shards; k++) {
+			printf("Lines in %s.%u : %u\n", input->outfile, k,
+			       input->shardcounts[k]);
+		}
 	} else {
 		perror("[sys_call] ");
 	}
@@ -1,12 +1,148 @@
 
+/*
+ * Sparse index of a sorted file, written next to the merge output.
+ * The file is a xidxhdr followed by @entries fixed size xidxent records
+ * in file order, so it can be mapped and binary searched as is
+ */
+#define XIDX_MAGIC 0x58494458
+#define XIDX_VERSION 1
+#define XIDX_KEY_LEN 24
+
+/*
+ * Header of a sparse index file
+ * @magic : XIDX_MAGIC
+ * @version : XIDX_VERSION
+ * @stride : one entry is recorded every @stride lines
+ * @keylen : bytes of key prefix kept per entry
+ * @entries : number of entries following the header
+ * @lines : number of lines in the indexed file
+ */
+typedef struct xidxhdr {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int stride;
+	unsigned int keylen;
+	unsigned long long entries;
+	unsigned long long lines;
+} xidxhdr;
+
+/*
+ * Entry of a sparse index file
+ * @offset : byte offset of the line in the indexed file
+ * @key : first bytes of the line without newline, zero padded
+ */
+typedef struct xidxent {
+	unsigned long long offset;
+	char key[XIDX_KEY_LEN];
+} xidxent;
+
+/*
+ * Front coded file of sorted lines. The file starts with XFC_MAGIC and
+ * the XFC_VERSION byte. The 0x89 leading the magic is not text, so a text
+ * file never passes for a front coded one. Then each line is stored as
+ * the number of leading bytes it shares with the line before it and the
+ * rest of the line, newline included:
+ *
+ *	shared (varint) | length of rest (varint) | rest
+ *
+ * varints are 7 bits a byte, low bits first, the top bit set on every
+ * byte but the last. Every @restart-th line, starting with the first,
+ * shares nothing so it can be decoded on its own; with an index written
+ * alongside, its entries point at these lines
+ */
+#define XFC_MAGIC "\x89" "XFC"
+#define XFC_MAGIC_LEN 4
+#define XFC_VERSION 1
+#define XFC_HEADER_LEN (XFC_MAGIC_LEN + 1)
+#define XFC_RESTART 16
+
+/*
+ * Structure updated by the kernel on every flush of the output while a
+ * merge runs, so other threads of the caller can follow its progress
+ * @in1_bytes : bytes of input file 1 merged so far
+ * @in2_bytes : bytes of input file 2 merged so far
+ * @out_bytes : bytes written to the output so far
+ * @lines : lines written to the output so far
+ * @done : set to 1 once the merge is finished
+ */
+typedef struct progress {
+	unsigned long long in1_bytes;
+	unsigned long long in2_bytes;
+	unsigned long long out_bytes;
+	unsigned int lines;
+	unsigned int done;
+} mergeprogress;
+
+/*
+ * Structure filled by a verify-only call
+ * @offset : byte offset of the first line out of order, -1 if sorted
+ * @line : line number of that line, starting from 1
+ */
+typedef struct sortcheck {
+	long long offset;
+	unsigned long long line;
+} sortcheck;
+
+/*
+ * Longest last line a continuation can carry, lines are at most a page
+ */
+#define XMERGE_LAST_LEN 4096
+
+/*
+ * Continuation of a merge into a user buffer. Zero it for the first
+ * call, then call again with the same structure while @more is set,
+ * after the filled part of the buffer has been consumed
+ * @filled : bytes put into the buffer by the last call
+ * @inpos1, @inpos2 : offset of the next line of each input to merge
+ * @lines : lines output over all calls so far
+ * @more : set if the buffer filled up before the end of the merge
+ * @last : last line output, lines from the next call are checked against it
+ */
+typedef struct mergecont {
+	unsigned long long filled;
+	long long inpos1;
+	long long inpos2;
+	unsigned int lines;
+	unsigned int more;
+	char last[XMERGE_LAST_LEN];
+} mergecont;
+
+/*
+ * Most outputs a sharded merge can write
+ */
+#define XMERGE_MAX_SHARDS 64
+
 /*
  *
  * Structure to take input from userland to kernel land
- * @infile1 : input file 1 for sorting
- * @infile2 : input file 2 for sorting
+ * @infile1 : input file 1 for sorting, the base of an incremental merge
+ * @infile2 : input file 2 for sorting, the delta of an incremental merge
  * @outfile : file path in which output needs to be written
  * @flags : options given by user for sorting
  * @data : pointer to int * where line count is stored if requested by user
+ * @ckptfile : file path of the checkpoint, used with checkpoint/resume flags
+ * @progress : pointer to mergeprogress updated during merge if requested
+ * @check : pointer to sortcheck filled by a verify-only call
+ * @idxfile : file path of the sparse index written with the output
+ * @idxstride : lines between two index entries
+ * @lokey : lines below this key are skipped with the key range flag
+ * @hikey : lines from this key on are skipped with the key range flag
+ * @key : xcrypt key of the encrypted inputs and output
+ * @keylen : length of @key, must be 16
+ * @checksum : pointer to unsigned int receiving the crc32c of the output
+ * @sumfile : file path of the checksum sidecar, or NULL for none
+ * @ubuf : user buffer the merge is written to instead of outfile
+ * @ubuflen : size of @ubuf
+ * @cont : continuation of a merge into @ubuf
+ * @limit : number of output lines after which the merge stops
+ * @shards : number of outputs of a sharded merge, written to outfile.0,
+ * outfile.1 and so on
+ * @shardkeys : @shards - 1 ascending keys of range shards, shard k gets
+ * the lines from key k - 1 up to key k
+ * @shardcounts : @shards unsigned ints receiving the lines of each shard,
+ * or NULL
+ * @restart : lines between restart points of a front coded output, 0 for
+ * the index stride if an index is written, XFC_RESTART otherwise
  *
  */
 typedef struct input {
@@ -15,4 +151,23 @@ typedef struct input {
 	char *outfile;
 	unsigned int flags;
 	unsigned int *data;
+	char *ckptfile;
+	mergeprogress *progress;
+	sortcheck *check;
+	char *idxfile;
+	unsigned int idxstride;
+	char *lokey;
+	char *hikey;
+	unsigned char *key;
+	unsigned int keylen;
+	unsigned int *checksum;
+	char *sumfile;
+	char *ubuf;
+	unsigned long long ubuflen;
+	mergecont *cont;
+	unsigned int limit;
+	unsigned int shards;
+	char **shardkeys;
+	unsigned int *shardcounts;
+	unsigned int restart;
 } fileinput;
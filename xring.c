@@ -0,0 +1,496 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/cred.h>
+#include <linux/sched.h>
+#include <linux/mmu_context.h>
+#include <linux/fs_struct.h>
+#include <linux/path.h>
+#include "xring.h"
+
+/*
+ * engines exported by the xmergesort and xcrypt modules
+ */
+asmlinkage extern long xmergesort(void *arg);
+asmlinkage extern long xcrypt(void *arg);
+
+/*
+ * number of worker threads per ring, 0 means one per online cpu
+ */
+static int ring_workers;
+module_param(ring_workers, int, 0644);
+MODULE_PARM_DESC(ring_workers, "threads running the operations of a ring, 0 for one per cpu");
+
+/*
+ * State of one open of the device
+ * @hdr : start of the shared mapping, NULL until XRING_IOC_SETUP
+ * @sqes : submission ring in the mapping
+ * @cqes : completion ring in the mapping
+ * @entries : number of entries of each ring
+ * @sq_head : next submission to take, the copy in @hdr is only published
+ * @cq_tail : next completion slot, the copy in @hdr is only published
+ * @sq_lock : taken to consume a submission
+ * @cq_lock : taken to post a completion
+ * @sq_wait : workers sleep here until submissions are entered
+ * @cq_wait : woken when a completion is posted
+ * @cq_space : workers sleep here while the completion ring is full
+ * @workers : worker threads
+ * @nworkers : number of started workers
+ * @mm : address space of the process that set the ring up, only that
+ * process can map the ring and enter submissions
+ * @cred : credentials the operations run with
+ * @root, @pwd : root and working directory paths are resolved against,
+ * those of the process that set the ring up
+ * @umask : umask files are created with
+ * @lock : serialises setup against mmap and the other ioctls
+ */
+typedef struct xringctx {
+	xringhdr *hdr;
+	xringsqe *sqes;
+	xringcqe *cqes;
+	unsigned int entries;
+	unsigned int sq_head;
+	unsigned int cq_tail;
+	spinlock_t sq_lock;
+	spinlock_t cq_lock;
+	wait_queue_head_t sq_wait;
+	wait_queue_head_t cq_wait;
+	wait_queue_head_t cq_space;
+	struct task_struct **workers;
+	int nworkers;
+	struct mm_struct *mm;
+	const struct cred *cred;
+	struct path root;
+	struct path pwd;
+	int umask;
+	struct mutex lock;
+} xringctx;
+
+/*
+ * xring_sq_pending : check if submissions are waiting to be taken
+ */
+static int
+xring_sq_pending(xringctx *ctx) {
+	return smp_load_acquire(&ctx->hdr->sq_tail) != READ_ONCE(ctx->sq_head);
+}
+
+/*
+ * xring_cq_ready : number of completions posted and not reaped yet
+ */
+static unsigned int
+xring_cq_ready(xringctx *ctx) {
+	return READ_ONCE(ctx->cq_tail) - READ_ONCE(ctx->hdr->cq_head);
+}
+
+/*
+ * xring_sq_take : take the next submission
+ * @ctx : ring
+ * @sqe : filled with a copy of the submission, the slot is given back to
+ * user as soon as sq_head moves
+ *
+ * returns 1 if a submission was taken, 0 if the ring is empty
+ */
+static int
+xring_sq_take(xringctx *ctx, xringsqe *sqe) {
+	unsigned int tail;
+	int taken = 0;
+
+	spin_lock(&ctx->sq_lock);
+	tail = smp_load_acquire(&ctx->hdr->sq_tail);
+	if (tail - ctx->sq_head > ctx->entries) {
+		/* user moved the tail past the ring, drop what is there */
+		printk(KERN_ERR "xring: bad submission tail %u\n", tail);
+		ctx->sq_head = tail;
+	} else if (tail != ctx->sq_head) {
+		*sqe = ctx->sqes[ctx->sq_head & (ctx->entries - 1)];
+		ctx->sq_head++;
+		taken = 1;
+	}
+	smp_store_release(&ctx->hdr->sq_head, ctx->sq_head);
+	spin_unlock(&ctx->sq_lock);
+	return taken;
+}
+
+/*
+ * xring_cq_post : post the completion of a submission
+ * @ctx : ring
+ * @user_data : user data of the submission
+ * @res : result of the operation
+ *
+ * waits for user to reap completions if the ring is full. The completion
+ * is dropped if the ring is torn down meanwhile
+ */
+static void
+xring_cq_post(xringctx *ctx, unsigned long long user_data, long res) {
+	xringcqe *cqe;
+
+	for (;;) {
+		spin_lock(&ctx->cq_lock);
+		if (xring_cq_ready(ctx) < ctx->entries) {
+			cqe = &ctx->cqes[ctx->cq_tail & (ctx->entries - 1)];
+			cqe->user_data = user_data;
+			cqe->res = res;
+			ctx->cq_tail++;
+			smp_store_release(&ctx->hdr->cq_tail, ctx->cq_tail);
+			spin_unlock(&ctx->cq_lock);
+			wake_up_all(&ctx->cq_wait);
+			return;
+		}
+		spin_unlock(&ctx->cq_lock);
+		wait_event_interruptible(ctx->cq_space,
+					 xring_cq_ready(ctx) < ctx->entries
+					 || kthread_should_stop());
+		if (kthread_should_stop())
+			return;
+	}
+}
+
+/*
+ * xring_run : run one operation in the context of the submitter
+ * @ctx : ring
+ * @sqe : submission
+ *
+ * the engines take user pointers, so the worker borrows the address space
+ * of the process that set the ring up, and its credentials so files are
+ * opened with its rights. Its root and working directory were taken over
+ * by xring_fs_enter when the worker started
+ *
+ * returns the result of the operation
+ */
+static long
+xring_run(xringctx *ctx, xringsqe *sqe) {
+	const struct cred *oldcred;
+	mm_segment_t oldfs;
+	void *arg = (void *) (unsigned long) sqe->arg;
+	long res;
+
+	/* the process went away, nobody can reap the result anyway */
+	if (!atomic_inc_not_zero(&ctx->mm->mm_users))
+		return -ESRCH;
+	oldcred = override_creds(ctx->cred);
+	use_mm(ctx->mm);
+	oldfs = get_fs();
+	set_fs(USER_DS);
+
+	switch (sqe->op) {
+	case XRING_OP_MERGE:
+		res = xmergesort(arg);
+		break;
+	case XRING_OP_CRYPT:
+		res = xcrypt(arg);
+		break;
+	default:
+		res = -EINVAL;
+		break;
+	}
+
+	set_fs(oldfs);
+	unuse_mm(ctx->mm);
+	revert_creds(oldcred);
+	mmput(ctx->mm);
+	return res;
+}
+
+/*
+ * xring_fs_enter : give the worker the root, working directory and umask
+ * of the process that set the ring up
+ * @ctx : ring
+ *
+ * kernel threads share the fs_struct of init, so paths would be resolved
+ * from the host root whatever the chroot or mount namespace of the
+ * submitter. The worker gets a private fs_struct first, it serves this
+ * ring only, so it is switched once for all its operations
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+xring_fs_enter(xringctx *ctx) {
+	struct fs_struct *fs;
+	struct path old_root;
+	struct path old_pwd;
+	int err;
+
+	err = unshare_fs_struct();
+	if (err < 0)
+		return err;
+	fs = current->fs;
+	path_get(&ctx->root);
+	path_get(&ctx->pwd);
+	spin_lock(&fs->lock);
+	write_seqcount_begin(&fs->seq);
+	old_root = fs->root;
+	old_pwd = fs->pwd;
+	fs->root = ctx->root;
+	fs->pwd = ctx->pwd;
+	fs->umask = ctx->umask;
+	write_seqcount_end(&fs->seq);
+	spin_unlock(&fs->lock);
+	path_put(&old_root);
+	path_put(&old_pwd);
+	return 0;
+}
+
+/*
+ * xring_worker : worker thread, runs submissions until the ring is torn down
+ *
+ * a worker that could not take over the root of the submitter fails
+ * every operation instead of running it from the host root
+ */
+static int
+xring_worker(void *data) {
+	xringctx *ctx = data;
+	xringsqe sqe;
+	long res;
+	int fserr;
+
+	fserr = xring_fs_enter(ctx);
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(ctx->sq_wait, xring_sq_pending(ctx)
+					 || kthread_should_stop());
+		if (!xring_sq_take(ctx, &sqe))
+			continue;
+		res = fserr ? fserr : xring_run(ctx, &sqe);
+		xring_cq_post(ctx, sqe.user_data, res);
+	}
+	return 0;
+}
+
+/*
+ * xring_teardown : stop the workers and free the rings, operations that
+ * are running finish first
+ */
+static void
+xring_teardown(xringctx *ctx) {
+	int n;
+
+	for (n = 0; n < ctx->nworkers; n++)
+		kthread_stop(ctx->workers[n]);
+	ctx->nworkers = 0;
+	kfree(ctx->workers);
+	ctx->workers = NULL;
+	if (ctx->hdr)
+		vfree(ctx->hdr);
+	ctx->hdr = NULL;
+	if (ctx->mm)
+		mmdrop(ctx->mm);
+	ctx->mm = NULL;
+	if (ctx->cred)
+		put_cred(ctx->cred);
+	ctx->cred = NULL;
+	if (ctx->root.dentry)
+		path_put(&ctx->root);
+	if (ctx->pwd.dentry)
+		path_put(&ctx->pwd);
+	memset(&ctx->root, 0, sizeof(struct path));
+	memset(&ctx->pwd, 0, sizeof(struct path));
+}
+
+/*
+ * xring_setup : allocate the rings and start the workers
+ * @ctx : ring, with @lock held
+ * @entries : number of entries of each ring
+ *
+ * returns 0 on success, -ve in case of error
+ */
+static int
+xring_setup(xringctx *ctx, unsigned int entries) {
+	struct task_struct *task;
+	int err = 0;
+	int n;
+
+	if (ctx->hdr)
+		return -EBUSY;
+	if (entries == 0 || entries > XRING_MAX_ENTRIES
+	    || (entries & (entries - 1)) != 0)
+		return -EINVAL;
+
+	ctx->hdr = vmalloc_user(PAGE_ALIGN(XRING_MAP_SIZE(entries)));
+	if (ctx->hdr == NULL)
+		return -ENOMEM;
+	ctx->hdr->entries = entries;
+	ctx->hdr->mask = entries - 1;
+	ctx->sqes = (xringsqe *) ((char *) ctx->hdr + XRING_SQ_OFF);
+	ctx->cqes = (xringcqe *) ((char *) ctx->hdr + XRING_CQ_OFF(entries));
+	ctx->entries = entries;
+
+	/* keep the mm_struct, not the address space, alive for the workers */
+	ctx->mm = current->mm;
+	atomic_inc(&ctx->mm->mm_count);
+	ctx->cred = get_current_cred();
+	get_fs_root(current->fs, &ctx->root);
+	get_fs_pwd(current->fs, &ctx->pwd);
+	ctx->umask = current_umask();
+
+	n = ring_workers > 0 ? ring_workers : num_online_cpus();
+	if (n > entries)
+		n = entries;
+	ctx->workers = kcalloc(n, sizeof(struct task_struct *), GFP_KERNEL);
+	if (ctx->workers == NULL) {
+		err = -ENOMEM;
+		goto OUT_SETUP;
+	}
+	for (ctx->nworkers = 0; ctx->nworkers < n; ctx->nworkers++) {
+		task = kthread_run(xring_worker, ctx, "xring/%d", ctx->nworkers);
+		if (IS_ERR(task)) {
+			err = PTR_ERR(task);
+			goto OUT_SETUP;
+		}
+		ctx->workers[ctx->nworkers] = task;
+	}
+	return 0;
+
+OUT_SETUP:
+	xring_teardown(ctx);
+	return err;
+}
+
+static int
+xring_open(struct inode *inode, struct file *filp) {
+	xringctx *ctx;
+
+	ctx = kzalloc(sizeof(xringctx), GFP_KERNEL);
+	if (ctx == NULL)
+		return -ENOMEM;
+	spin_lock_init(&ctx->sq_lock);
+	spin_lock_init(&ctx->cq_lock);
+	init_waitqueue_head(&ctx->sq_wait);
+	init_waitqueue_head(&ctx->cq_wait);
+	init_waitqueue_head(&ctx->cq_space);
+	mutex_init(&ctx->lock);
+	filp->private_data = ctx;
+	return 0;
+}
+
+static int
+xring_release(struct inode *inode, struct file *filp) {
+	xringctx *ctx = filp->private_data;
+
+	xring_teardown(ctx);
+	kfree(ctx);
+	return 0;
+}
+
+static long
+xring_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+	xringctx *ctx = filp->private_data;
+	xringhdr *hdr;
+	int err;
+
+	mutex_lock(&ctx->lock);
+	if (cmd == XRING_IOC_SETUP) {
+		err = xring_setup(ctx, arg);
+		mutex_unlock(&ctx->lock);
+		return err;
+	}
+	hdr = ctx->hdr;
+	mutex_unlock(&ctx->lock);
+	if (hdr == NULL)
+		return -ENXIO;
+
+	/* operations run as the process that set the ring up, only it enters them */
+	if (current->mm != ctx->mm)
+		return -EPERM;
+
+	switch (cmd) {
+	case XRING_IOC_ENTER:
+		wake_up_all(&ctx->cq_space);
+		wake_up_all(&ctx->sq_wait);
+		return 0;
+	case XRING_IOC_WAIT:
+		if (arg > ctx->entries)
+			return -EINVAL;
+		wake_up_all(&ctx->cq_space);
+		return wait_event_interruptible(ctx->cq_wait,
+						xring_cq_ready(ctx) >= arg);
+	}
+	return -ENOTTY;
+}
+
+static int
+xring_mmap(struct file *filp, struct vm_area_struct *vma) {
+	xringctx *ctx = filp->private_data;
+	int err = -ENXIO;
+
+	mutex_lock(&ctx->lock);
+	if (ctx->hdr == NULL)
+		goto OUT_MMAP;
+	err = -EPERM;
+	if (current->mm != ctx->mm)
+		goto OUT_MMAP;
+	err = -EINVAL;
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start
+	    > PAGE_ALIGN(XRING_MAP_SIZE(ctx->entries)))
+		goto OUT_MMAP;
+	err = remap_vmalloc_range(vma, ctx->hdr, 0);
+OUT_MMAP:
+	mutex_unlock(&ctx->lock);
+	return err;
+}
+
+/*
+ * xring_poll : readable while completions wait to be reaped
+ */
+static unsigned int
+xring_poll(struct file *filp, poll_table *wait) {
+	xringctx *ctx = filp->private_data;
+	unsigned int mask = 0;
+
+	if (ctx->hdr == NULL)
+		return POLLERR;
+	poll_wait(filp, &ctx->cq_wait, wait);
+	if (xring_cq_ready(ctx) > 0)
+		mask |= POLLIN | POLLRDNORM;
+	return mask;
+}
+
+static const struct file_operations xring_fops = {
+	.owner = THIS_MODULE,
+	.open = xring_open,
+	.release = xring_release,
+	.unlocked_ioctl = xring_ioctl,
+	.mmap = xring_mmap,
+	.poll = xring_poll,
+};
+
+static struct miscdevice xring_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "xring",
+	.fops = &xring_fops,
+};
+
+/*Entry Function of xring module*/
+static int __init init_xring(void)
+{
+	int err;
+
+	err = misc_register(&xring_dev);
+	if (err < 0) {
+		printk(KERN_ERR "xring: can not register device\n");
+		return err;
+	}
+	printk(KERN_INFO "installed new xring module\n");
+	return 0;
+}
+
+/*Exit function of xring module*/
+static void __exit exit_xring(void)
+{
+	misc_deregister(&xring_dev);
+	printk(KERN_INFO "removed xring module\n");
+}
+
+module_init(init_xring);
+module_exit(exit_xring);
+MODULE_LICENSE("GPL");
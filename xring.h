@@ -0,0 +1,92 @@
+#ifndef _XRING_H
+#define _XRING_H
+
+#ifdef __KERNEL__
+#include <linux/ioctl.h>
+#else
+#include <sys/ioctl.h>
+#endif
+
+/*
+ * Shared memory rings of the /dev/xring device, used to queue merge and
+ * crypt operations without one system call per operation.
+ *
+ * The ring is sized with XRING_IOC_SETUP and mapped with mmap of
+ * XRING_MAP_SIZE(entries) bytes at offset 0. The mapping holds a
+ * xringhdr, the submission entries at XRING_SQ_OFF and the completion
+ * entries at XRING_CQ_OFF(entries). Userspace fills sqes[sq_tail & mask],
+ * moves sq_tail and calls XRING_IOC_ENTER once for the whole batch.
+ * Completions are reaped from cq_head, in any order of submission.
+ *
+ * Operations run in kernel threads with the credentials, root, working
+ * directory and umask the process that set the ring up had at setup time.
+ * The ring belongs to that process, any other process holding the file
+ * gets EPERM from mmap and from ENTER and WAIT
+ */
+#define XRING_MAX_ENTRIES 4096
+#define XRING_SQ_OFF 4096
+#define XRING_CQ_OFF(n) (XRING_SQ_OFF + (n) * sizeof(xringsqe))
+#define XRING_MAP_SIZE(n) (XRING_CQ_OFF(n) + (n) * sizeof(xringcqe))
+
+/*
+ * operations, @arg points to a fileinput for a merge and to the struct
+ * xcrypt takes for a crypt
+ */
+#define XRING_OP_MERGE 1
+#define XRING_OP_CRYPT 2
+
+/*
+ * XRING_IOC_SETUP : allocate rings of the power of two number of entries
+ * given as argument
+ * XRING_IOC_ENTER : start the workers on the submitted entries
+ * XRING_IOC_WAIT : sleep until at least the number of completions given
+ * as argument are posted
+ * ENTER and WAIT also tell the workers that completions were reaped, so
+ * workers waiting for room in a full completion ring carry on
+ */
+#define XRING_IOC_SETUP _IO('x', 1)
+#define XRING_IOC_ENTER _IO('x', 2)
+#define XRING_IOC_WAIT _IO('x', 3)
+
+/*
+ * Header at the start of the mapping
+ * @sq_head : next submission the kernel takes, written by kernel
+ * @sq_tail : one past the last submission, written by user
+ * @cq_head : next completion user reaps, written by user
+ * @cq_tail : one past the last completion, written by kernel
+ * @entries : number of entries of each ring
+ * @mask : @entries - 1, indexes wrap around with it
+ */
+typedef struct xringhdr {
+	unsigned int sq_head;
+	unsigned int sq_tail;
+	unsigned int cq_head;
+	unsigned int cq_tail;
+	unsigned int entries;
+	unsigned int mask;
+} xringhdr;
+
+/*
+ * Submission entry
+ * @op : XRING_OP_MERGE or XRING_OP_CRYPT
+ * @arg : user pointer to the argument structure of the operation
+ * @user_data : copied as is to the completion
+ */
+typedef struct xringsqe {
+	unsigned int op;
+	unsigned int pad;
+	unsigned long long arg;
+	unsigned long long user_data;
+} xringsqe;
+
+/*
+ * Completion entry
+ * @user_data : @user_data of the submission
+ * @res : return value of the operation, -ve errno on failure
+ */
+typedef struct xringcqe {
+	unsigned long long user_data;
+	long long res;
+} xringcqe;
+
+#endif